@@ -0,0 +1,990 @@
+#include "util.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <varlink.h>
+
+/*
+ * Starts the resolver on a temporary socket with a synthetic
+ * configuration and measures the latency of concurrent calls. The
+ * configured services point back to this executable, which answers a
+ * single connection and exits, to measure activations as well.
+ *
+ * With --burst=N, N clients connect to N different services at once
+ * instead, and the latency of the activations and the system calls of
+ * the resolver's main loop are reported. With --startup=N, the resolver
+ * is only started N times, to measure the startup with --services.
+ */
+
+typedef enum {
+        OPERATION_RESOLVE,
+        OPERATION_RESOLVE_MANY,
+        OPERATION_GET_INFO,
+        OPERATION_ACTIVATE,
+        _OPERATION_MAX
+} Operation;
+
+static const char *operation_names[_OPERATION_MAX] = {
+        [OPERATION_RESOLVE] = "Resolve",
+        [OPERATION_RESOLVE_MANY] = "ResolveMany",
+        [OPERATION_GET_INFO] = "GetInfo",
+        [OPERATION_ACTIVATE] = "activation",
+};
+
+typedef struct {
+        uint64_t *samples;
+        unsigned long n_samples;
+        unsigned long n_errors;
+} Latencies;
+
+typedef struct {
+        char directory[64];
+        char *address;
+
+        unsigned long n_services;
+        unsigned long n_interfaces;
+        unsigned long n_clients;
+        unsigned long n_requests;
+        unsigned long batch;
+        unsigned long info_every;
+        unsigned long activate_every;
+        unsigned long burst;
+        unsigned long n_starts;
+
+        pthread_barrier_t barrier;
+} Benchmark;
+
+typedef struct {
+        Benchmark *benchmark;
+        pthread_t thread;
+        unsigned int seed;
+        long error;
+
+        Latencies latencies[_OPERATION_MAX];
+} Client;
+
+typedef struct Burst Burst;
+
+typedef struct {
+        Burst *burst;
+        pthread_t thread;
+        unsigned long service;
+        uint64_t start;
+        uint64_t latency;
+        long error;
+} BurstClient;
+
+struct Burst {
+        Benchmark *benchmark;
+        BurstClient *clients;
+        unsigned long n_clients;
+        pid_t pid;
+        bool traced;
+        bool done;
+        uint64_t duration;
+
+        pthread_barrier_t barrier;
+};
+
+typedef struct {
+        bool done;
+        bool failed;
+} Reply;
+
+static long reply_callback(VarlinkConnection *connection,
+                           const char *error,
+                           VarlinkObject *parameters,
+                           uint64_t flags,
+                           void *userdata) {
+        Reply *reply = userdata;
+
+        reply->done = true;
+        reply->failed = error != NULL;
+
+        return 0;
+}
+
+/* Sends the call and runs the connection until the reply arrived. */
+static long call_wait(VarlinkConnection *connection, const char *method, VarlinkObject *parameters, bool *failedp) {
+        Reply reply = {};
+        long r;
+
+        r = varlink_connection_call(connection, method, parameters, 0, reply_callback, &reply);
+        if (r < 0)
+                return r;
+
+        while (!reply.done) {
+                struct pollfd pfd = {
+                        .fd = varlink_connection_get_fd(connection),
+                        .events = varlink_connection_get_events(connection),
+                };
+
+                if (poll(&pfd, 1, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                }
+
+                r = varlink_connection_process_events(connection, pfd.revents);
+                if (r < 0)
+                        return r;
+        }
+
+        *failedp = reply.failed;
+
+        return 0;
+}
+
+static void service_path(Benchmark *b, unsigned long service, char *path, unsigned long size) {
+        snprintf(path, size, "%s/service-%lu", b->directory, service);
+}
+
+/* Connects to a service and waits for the activated child to answer. */
+static long activate(Benchmark *b, unsigned long service) {
+        struct sockaddr_un sa = {
+                .sun_family = AF_UNIX,
+        };
+        _cleanup_(closep) int fd = -1;
+        char c;
+
+        service_path(b, service, sa.sun_path, sizeof(sa.sun_path));
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+                return -errno;
+
+        if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+                return -errno;
+
+        if (read(fd, &c, 1) != 1)
+                return -EIO;
+
+        return 0;
+}
+
+static Operation client_next_operation(Client *c, unsigned long request) {
+        Benchmark *b = c->benchmark;
+
+        if (b->activate_every > 0 && request % b->activate_every == b->activate_every - 1)
+                return OPERATION_ACTIVATE;
+
+        if (b->info_every > 0 && request % b->info_every == b->info_every - 1)
+                return OPERATION_GET_INFO;
+
+        if (b->batch > 0)
+                return OPERATION_RESOLVE_MANY;
+
+        return OPERATION_RESOLVE;
+}
+
+static long client_run_one(Client *c, VarlinkConnection *connection, Operation operation, bool *failedp) {
+        Benchmark *b = c->benchmark;
+        unsigned long service = rand_r(&c->seed) % b->n_services;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
+        _cleanup_(varlink_array_unrefp) VarlinkArray *interfaces = NULL;
+        char interface[128];
+
+        switch (operation) {
+                case OPERATION_RESOLVE:
+                        snprintf(interface, sizeof(interface), "com.example.benchmark.service%lu.interface%lu",
+                                 service, rand_r(&c->seed) % b->n_interfaces);
+
+                        varlink_object_new(&parameters);
+                        varlink_object_set_string(parameters, "interface", interface);
+
+                        return call_wait(connection, "org.varlink.resolver.Resolve", parameters, failedp);
+
+                case OPERATION_RESOLVE_MANY:
+                        varlink_array_new(&interfaces);
+
+                        for (unsigned long i = 0; i < b->batch; i += 1) {
+                                snprintf(interface, sizeof(interface), "com.example.benchmark.service%lu.interface%lu",
+                                         rand_r(&c->seed) % b->n_services, rand_r(&c->seed) % b->n_interfaces);
+                                varlink_array_append_string(interfaces, interface);
+                        }
+
+                        varlink_object_new(&parameters);
+                        varlink_object_set_array(parameters, "interfaces", interfaces);
+
+                        return call_wait(connection, "com.redhat.resolver.ResolveMany", parameters, failedp);
+
+                case OPERATION_GET_INFO:
+                        return call_wait(connection, "org.varlink.resolver.GetInfo", NULL, failedp);
+
+                case OPERATION_ACTIVATE:
+                        *failedp = activate(b, service) < 0;
+                        return 0;
+
+                case _OPERATION_MAX:
+                default:
+                        abort();
+        }
+}
+
+static void *client_run(void *userdata) {
+        Client *c = userdata;
+        Benchmark *b = c->benchmark;
+        _cleanup_(varlink_connection_freep) VarlinkConnection *connection = NULL;
+
+        c->error = varlink_connection_new(&connection, b->address);
+        pthread_barrier_wait(&b->barrier);
+        if (c->error < 0)
+                return NULL;
+
+        for (unsigned long i = 0; i < b->n_requests; i += 1) {
+                Operation operation = client_next_operation(c, i);
+                Latencies *latencies = &c->latencies[operation];
+                bool failed = false;
+                uint64_t start;
+
+                start = now_usec();
+
+                c->error = client_run_one(c, connection, operation, &failed);
+                if (c->error < 0)
+                        return NULL;
+
+                latencies->samples[latencies->n_samples] = now_usec() - start;
+                latencies->n_samples += 1;
+                if (failed)
+                        latencies->n_errors += 1;
+        }
+
+        return NULL;
+}
+
+static void *burst_client_run(void *userdata) {
+        BurstClient *c = userdata;
+
+        pthread_barrier_wait(&c->burst->barrier);
+
+        c->start = now_usec();
+        c->error = activate(c->burst->benchmark, c->service);
+        c->latency = now_usec() - c->start;
+
+        return NULL;
+}
+
+/* Releases the clients at once, and stops the tracer when all of them were answered. */
+static void *burst_run(void *userdata) {
+        Burst *burst = userdata;
+        uint64_t start = UINT64_MAX;
+        uint64_t end = 0;
+
+        for (unsigned long i = 0; i < burst->n_clients; i += 1)
+                pthread_create(&burst->clients[i].thread, NULL, burst_client_run, &burst->clients[i]);
+
+        pthread_barrier_wait(&burst->barrier);
+
+        for (unsigned long i = 0; i < burst->n_clients; i += 1) {
+                BurstClient *c = &burst->clients[i];
+
+                pthread_join(c->thread, NULL);
+                start = MIN(start, c->start);
+                end = MAX(end, c->start + c->latency);
+        }
+
+        burst->duration = end - start;
+
+        __atomic_store_n(&burst->done, true, __ATOMIC_SEQ_CST);
+        if (burst->traced)
+                syscall(SYS_tgkill, burst->pid, burst->pid, SIGWINCH);
+
+        return NULL;
+}
+
+/*
+ * Traces the main thread of the resolver, which runs the activations.
+ * The other threads and the children are not traced.
+ */
+static long benchmark_trace_start(pid_t pid) {
+        int status;
+
+        if (ptrace(PTRACE_SEIZE, pid, NULL, (void *)PTRACE_O_TRACESYSGOOD) < 0)
+                return -errno;
+
+        if (ptrace(PTRACE_INTERRUPT, pid, NULL, NULL) < 0)
+                return -errno;
+
+        if (waitpid(pid, &status, __WALL) < 0)
+                return -errno;
+
+        if (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) < 0)
+                return -errno;
+
+        return 0;
+}
+
+/*
+ * Counts the system calls until the burst is done; every call stops
+ * the tracee at its entry and at its exit. The SIGWINCH from burst_run()
+ * is not passed on, the resolver ignores it anyway.
+ */
+static long benchmark_trace(Burst *burst, unsigned long *n_syscallsp) {
+        unsigned long n_stops = 0;
+        int status;
+
+        for (;;) {
+                int sig = 0;
+
+                if (waitpid(burst->pid, &status, __WALL) < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                }
+
+                if (!WIFSTOPPED(status))
+                        return -ECHILD;
+
+                if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+                        n_stops += 1;
+                else if (WSTOPSIG(status) == SIGWINCH && __atomic_load_n(&burst->done, __ATOMIC_SEQ_CST))
+                        break;
+                else if (status >> 16 != PTRACE_EVENT_STOP)
+                        sig = WSTOPSIG(status);
+
+                if (ptrace(PTRACE_SYSCALL, burst->pid, NULL, (void *)(long)sig) < 0)
+                        return -errno;
+        }
+
+        if (ptrace(PTRACE_DETACH, burst->pid, NULL, NULL) < 0)
+                return -errno;
+
+        *n_syscallsp = n_stops / 2;
+
+        return 0;
+}
+
+/* Connects to the services from first on at once, every connection activates one. */
+static long benchmark_burst(Benchmark *b,
+                            pid_t pid,
+                            unsigned long first,
+                            bool trace,
+                            uint64_t *samples,
+                            uint64_t *durationp,
+                            unsigned long *n_errorsp,
+                            unsigned long *n_syscallsp) {
+        _cleanup_(freep) BurstClient *clients = NULL;
+        Burst burst = {
+                .benchmark = b,
+                .n_clients = b->burst,
+                .pid = pid,
+                .traced = trace,
+        };
+        unsigned long n_errors = 0;
+        pthread_t thread;
+        long r = 0;
+
+        clients = calloc(b->burst, sizeof(BurstClient));
+        if (!clients)
+                return -ENOMEM;
+
+        for (unsigned long i = 0; i < b->burst; i += 1) {
+                clients[i].burst = &burst;
+                clients[i].service = first + i;
+        }
+
+        burst.clients = clients;
+
+        if (trace) {
+                r = benchmark_trace_start(pid);
+                if (r < 0)
+                        return r;
+        }
+
+        pthread_barrier_init(&burst.barrier, NULL, b->burst + 1);
+        pthread_create(&thread, NULL, burst_run, &burst);
+
+        /* A stopped resolver would leave the clients waiting for their answer. */
+        if (trace) {
+                r = benchmark_trace(&burst, n_syscallsp);
+                if (r < 0)
+                        kill(pid, SIGKILL);
+        }
+
+        pthread_join(thread, NULL);
+        pthread_barrier_destroy(&burst.barrier);
+
+        for (unsigned long i = 0; i < b->burst; i += 1) {
+                samples[i] = clients[i].latency;
+                if (clients[i].error < 0)
+                        n_errors += 1;
+        }
+
+        *durationp = burst.duration;
+        *n_errorsp = n_errors;
+
+        return r;
+}
+
+static long benchmark_write_config(Benchmark *b, const char *path, const char *executable) {
+        _cleanup_(fclosep) FILE *f = NULL;
+
+        f = fopen(path, "we");
+        if (!f)
+                return -errno;
+
+        fprintf(f, "{\n  \"services\": [\n");
+
+        for (unsigned long s = 0; s < b->n_services; s += 1) {
+                char socket_path[108];
+
+                service_path(b, s, socket_path, sizeof(socket_path));
+                fprintf(f, "    {\n      \"address\": \"unix:%s\",\n", socket_path);
+                fprintf(f, "      \"executable\": { \"path\": \"%s\" },\n", executable);
+                fprintf(f, "      \"interfaces\": [");
+
+                for (unsigned long i = 0; i < b->n_interfaces; i += 1)
+                        fprintf(f, "%s\"com.example.benchmark.service%lu.interface%lu\"", i > 0 ? ", " : " ", s, i);
+
+                fprintf(f, " ]\n    }%s\n", s + 1 < b->n_services ? "," : "");
+        }
+
+        fprintf(f, "  ]\n}\n");
+
+        if (fflush(f) != 0)
+                return -errno;
+
+        return 0;
+}
+
+/* Waits until the resolver accepts connections on its socket. */
+static long benchmark_wait_for_resolver(Benchmark *b, pid_t pid) {
+        struct sockaddr_un sa = {
+                .sun_family = AF_UNIX,
+        };
+
+        snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/resolver", b->directory);
+
+        for (unsigned long i = 0; i < 5000; i += 1) {
+                _cleanup_(closep) int fd = -1;
+
+                if (waitpid(pid, NULL, WNOHANG) == pid)
+                        return -ECHILD;
+
+                fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (fd < 0)
+                        return -errno;
+
+                if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+                        return 0;
+
+                usleep(1000);
+        }
+
+        return -ETIMEDOUT;
+}
+
+/* Starts the resolver and returns the time until it answered the first Resolve. */
+static long benchmark_start_resolver(Benchmark *b, char **argv, pid_t *pidp, uint64_t *first_resolvep) {
+        _cleanup_(varlink_connection_freep) VarlinkConnection *connection = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
+        uint64_t start = now_usec();
+        bool failed = false;
+        pid_t pid;
+        long r;
+
+        pid = fork();
+        if (pid < 0)
+                return -errno;
+
+        if (pid == 0) {
+                execv(argv[0], argv);
+                _exit(EXIT_FAILURE);
+        }
+
+        *pidp = pid;
+
+        r = benchmark_wait_for_resolver(b, pid);
+        if (r < 0)
+                return r;
+
+        if (varlink_connection_new(&connection, b->address) < 0)
+                return -EIO;
+
+        varlink_object_new(&parameters);
+        varlink_object_set_string(parameters, "interface", "com.example.benchmark.service0.interface0");
+
+        r = call_wait(connection, "org.varlink.resolver.Resolve", parameters, &failed);
+        if (r < 0 || failed)
+                return -EIO;
+
+        *first_resolvep = now_usec() - start;
+
+        return 0;
+}
+
+static void benchmark_stop_resolver(pid_t *pidp) {
+        if (*pidp <= 0)
+                return;
+
+        kill(*pidp, SIGTERM);
+        waitpid(*pidp, NULL, 0);
+        *pidp = -1;
+}
+
+static int compare_samples(const void *p1, const void *p2) {
+        uint64_t a = *(const uint64_t *)p1;
+        uint64_t b = *(const uint64_t *)p2;
+
+        return a < b ? -1 : a > b;
+}
+
+static uint64_t percentile(uint64_t *samples, unsigned long n_samples, unsigned long per_mille) {
+        unsigned long i;
+
+        if (n_samples == 0)
+                return 0;
+
+        i = (n_samples * per_mille + 999) / 1000;
+
+        return samples[MAX(i, 1UL) - 1];
+}
+
+/* Every Resolve call resolves one interface, every ResolveMany call a batch. */
+static unsigned long operation_n_interfaces(Benchmark *b, Operation operation) {
+        switch (operation) {
+                case OPERATION_RESOLVE:
+                        return 1;
+
+                case OPERATION_RESOLVE_MANY:
+                        return b->batch;
+
+                case OPERATION_GET_INFO:
+                case OPERATION_ACTIVATE:
+                case _OPERATION_MAX:
+                default:
+                        return 0;
+        }
+}
+
+static void benchmark_report(Benchmark *b, Client *clients, uint64_t duration) {
+        printf("%-12s %10s %8s %12s %14s %10s %10s %10s\n",
+               "operation", "requests", "errors", "requests/s", "interfaces/s", "p50 (us)", "p99 (us)", "p999 (us)");
+
+        for (Operation o = 0; o < _OPERATION_MAX; o += 1) {
+                _cleanup_(freep) uint64_t *samples = NULL;
+                unsigned long n_samples = 0;
+                unsigned long n_errors = 0;
+
+                samples = malloc(MAX(b->n_clients * b->n_requests, 1UL) * sizeof(uint64_t));
+                if (!samples)
+                        return;
+
+                for (unsigned long c = 0; c < b->n_clients; c += 1) {
+                        Latencies *latencies = &clients[c].latencies[o];
+
+                        memcpy(samples + n_samples, latencies->samples, latencies->n_samples * sizeof(uint64_t));
+                        n_samples += latencies->n_samples;
+                        n_errors += latencies->n_errors;
+                }
+
+                if (n_samples == 0)
+                        continue;
+
+                qsort(samples, n_samples, sizeof(uint64_t), compare_samples);
+
+                printf("%-12s %10lu %8lu %12.0f %14.0f %10lu %10lu %10lu\n",
+                       operation_names[o],
+                       n_samples,
+                       n_errors,
+                       (double)n_samples * USEC_PER_SEC / MAX(duration, 1ULL),
+                       (double)n_samples * operation_n_interfaces(b, o) * USEC_PER_SEC / MAX(duration, 1ULL),
+                       percentile(samples, n_samples, 500),
+                       percentile(samples, n_samples, 990),
+                       percentile(samples, n_samples, 999));
+        }
+}
+
+/*
+ * The first burst measures the latency, the second one, on other
+ * services, counts the system calls; tracing slows the resolver down.
+ */
+static long benchmark_run_burst(Benchmark *b, pid_t pid) {
+        _cleanup_(freep) uint64_t *samples = NULL;
+        unsigned long n_syscalls = 0;
+        unsigned long n_errors;
+        uint64_t duration;
+        long r;
+
+        samples = calloc(b->burst, sizeof(uint64_t));
+        if (!samples)
+                return -ENOMEM;
+
+        r = benchmark_burst(b, pid, 0, false, samples, &duration, &n_errors, NULL);
+        if (r < 0)
+                return r;
+
+        qsort(samples, b->burst, sizeof(uint64_t), compare_samples);
+
+        printf("burst of %lu activations, %lu services, %lu errors\n", b->burst, b->n_services, n_errors);
+        printf("%-12s %10s %10s %10s %10s\n", "", "p50 (us)", "p99 (us)", "max (us)", "all (us)");
+        printf("%-12s %10lu %10lu %10lu %10lu\n",
+               operation_names[OPERATION_ACTIVATE],
+               percentile(samples, b->burst, 500),
+               percentile(samples, b->burst, 990),
+               samples[b->burst - 1],
+               duration);
+
+        /* Not fatal, tracing might not be permitted. */
+        r = benchmark_burst(b, pid, b->burst, true, samples, &duration, &n_errors, &n_syscalls);
+        if (r < 0) {
+                fprintf(stderr, "Warning: counting system calls: %s\n", strerror(-r));
+                return 0;
+        }
+
+        printf("\nmain loop: %lu system calls, %.1f per activation\n", n_syscalls, (double)n_syscalls / b->burst);
+
+        return 0;
+}
+
+/* Reads the configuration and creates the listen sockets of all services, every time. */
+static long benchmark_run_startup(Benchmark *b, char **argv, bool snapshot) {
+        _cleanup_(freep) uint64_t *samples = NULL;
+        pid_t pid = -1;
+        long r;
+
+        samples = calloc(b->n_starts, sizeof(uint64_t));
+        if (!samples)
+                return -ENOMEM;
+
+        for (unsigned long i = 0; i < b->n_starts; i += 1) {
+                r = benchmark_start_resolver(b, argv, &pid, &samples[i]);
+                benchmark_stop_resolver(&pid);
+                if (r < 0)
+                        return r;
+        }
+
+        qsort(samples, b->n_starts, sizeof(uint64_t), compare_samples);
+
+        printf("%lu starts, %lu services, %lu interfaces each, configuration read from %s\n",
+               b->n_starts, b->n_services, b->n_interfaces, snapshot ? "the snapshot" : "JSON");
+        printf("%-14s %10s %10s %10s\n", "", "p50 (us)", "min (us)", "max (us)");
+        printf("%-14s %10lu %10lu %10lu\n",
+               "first resolve",
+               percentile(samples, b->n_starts, 500),
+               samples[0],
+               samples[b->n_starts - 1]);
+
+        return 0;
+}
+
+/* Every service holds a listen socket, the resolver inherits our limit. */
+static void raise_fd_limit(void) {
+        struct rlimit rl;
+
+        if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+                return;
+
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+static void remove_directory(const char *path) {
+        _cleanup_(closedirp) DIR *dir = NULL;
+        struct dirent *entry;
+
+        dir = opendir(path);
+        if (!dir)
+                return;
+
+        while ((entry = readdir(dir))) {
+                if (entry->d_name[0] == '.')
+                        continue;
+
+                unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+
+        rmdir(path);
+}
+
+/* Activated as one of the configured services: answer one connection. */
+static int serve(void) {
+        struct pollfd pfd = {
+                .fd = 3,
+                .events = POLLIN,
+        };
+        _cleanup_(closep) int fd = -1;
+
+        if (poll(&pfd, 1, 10 * 1000) <= 0)
+                return EXIT_FAILURE;
+
+        fd = accept4(3, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+                return errno == EAGAIN ? EXIT_SUCCESS : EXIT_FAILURE;
+
+        if (write(fd, "1", 1) != 1)
+                return EXIT_FAILURE;
+
+        return EXIT_SUCCESS;
+}
+
+static unsigned long parse_number(const char *arg, const char *name) {
+        char *end;
+        unsigned long n;
+
+        errno = 0;
+        n = strtoul(arg, &end, 10);
+        if (errno != 0 || *end != '\0') {
+                fprintf(stderr, "Error: invalid %s: %s\n", name, arg);
+                exit(EXIT_FAILURE);
+        }
+
+        return n;
+}
+
+int main(int argc, char **argv) {
+        static const struct option options[] = {
+                { "resolver", required_argument, NULL, 'r' },
+                { "services", required_argument, NULL, 's' },
+                { "interfaces", required_argument, NULL, 'i' },
+                { "clients", required_argument, NULL, 'c' },
+                { "requests", required_argument, NULL, 'n' },
+                { "batch", required_argument, NULL, 'b' },
+                { "threads", required_argument, NULL, 't' },
+                { "info-every", required_argument, NULL, 'I' },
+                { "activate-every", required_argument, NULL, 'A' },
+                { "burst", required_argument, NULL, 'B' },
+                { "startup", required_argument, NULL, 'U' },
+                { "snapshot", no_argument, NULL, 'S' },
+                { "help", no_argument, NULL, 'h' },
+                {}
+        };
+        Benchmark b = {
+                .n_services = 100,
+                .n_interfaces = 4,
+                .n_clients = 4,
+                .n_requests = 10000,
+                .info_every = 100,
+                .activate_every = 1000,
+        };
+        _cleanup_(freep) Client *clients = NULL;
+        char executable[PATH_MAX];
+        _cleanup_(freep) char *resolver = NULL;
+        _cleanup_(freep) char *config = NULL;
+        _cleanup_(freep) char *threads = NULL;
+        _cleanup_(freep) char *snapshot = NULL;
+        bool use_snapshot = false;
+        char *resolver_argv[6] = {};
+        unsigned long n_resolver_argv = 0;
+        pid_t pid = -1;
+        uint64_t first_resolve;
+        uint64_t start;
+        int c;
+        int status = EXIT_FAILURE;
+        long r;
+
+        /* The resolver passes the service address as the only argument. */
+        if (argc == 2 && strncmp(argv[1], "--varlink=", 10) == 0)
+                return serve();
+
+        r = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+        if (r < 0)
+                return EXIT_FAILURE;
+        executable[r] = '\0';
+
+        while ((c = getopt_long(argc, argv, "h", options, NULL)) >= 0) {
+                switch (c) {
+                        case 'r':
+                                free(resolver);
+                                resolver = strdup(optarg);
+                                break;
+
+                        case 's':
+                                b.n_services = parse_number(optarg, "number of services");
+                                break;
+
+                        case 'i':
+                                b.n_interfaces = parse_number(optarg, "number of interfaces");
+                                break;
+
+                        case 'c':
+                                b.n_clients = parse_number(optarg, "number of clients");
+                                break;
+
+                        case 'n':
+                                b.n_requests = parse_number(optarg, "number of requests");
+                                break;
+
+                        case 'b':
+                                b.batch = parse_number(optarg, "batch size");
+                                break;
+
+                        case 't':
+                                parse_number(optarg, "number of threads");
+                                free(threads);
+                                asprintf(&threads, "--threads=%s", optarg);
+                                break;
+
+                        case 'I':
+                                b.info_every = parse_number(optarg, "GetInfo interval");
+                                break;
+
+                        case 'A':
+                                b.activate_every = parse_number(optarg, "activation interval");
+                                break;
+
+                        case 'B':
+                                b.burst = parse_number(optarg, "burst size");
+                                break;
+
+                        case 'U':
+                                b.n_starts = parse_number(optarg, "number of starts");
+                                break;
+
+                        case 'S':
+                                use_snapshot = true;
+                                break;
+
+                        case 'h':
+                                printf("Usage: %s [--resolver=PATH] [--services=N] [--interfaces=N] [--clients=N]\n"
+                                       "       [--requests=N] [--batch=N] [--threads=N] [--info-every=N] [--activate-every=N]\n"
+                                       "       [--snapshot] [--burst=N] [--startup=N]\n\n",
+                                       program_invocation_short_name);
+                                return EXIT_SUCCESS;
+
+                        default:
+                                return EXIT_FAILURE;
+                }
+        }
+
+        if (b.n_services == 0 || b.n_interfaces == 0 || b.n_clients == 0) {
+                fprintf(stderr, "Error: services, interfaces and clients must not be zero\n");
+                return EXIT_FAILURE;
+        }
+
+        /* The resolver is built next to us. */
+        if (!resolver) {
+                char *slash = strrchr(executable, '/');
+
+                asprintf(&resolver, "%.*s/com.redhat.resolver", (int)(slash - executable), executable);
+        }
+
+        /* Both bursts activate services which were not activated before. */
+        b.n_services = MAX(b.n_services, 2 * b.burst);
+
+        signal(SIGPIPE, SIG_IGN);
+        raise_fd_limit();
+
+        strcpy(b.directory, "/tmp/resolver-benchmark-XXXXXX");
+        if (!mkdtemp(b.directory)) {
+                fprintf(stderr, "Error: creating temporary directory: %m\n");
+                return EXIT_FAILURE;
+        }
+
+        asprintf(&b.address, "unix:%s/resolver", b.directory);
+        asprintf(&config, "%s/config.json", b.directory);
+
+        r = benchmark_write_config(&b, config, executable);
+        if (r < 0) {
+                fprintf(stderr, "Error: writing configuration: %s\n", strerror(-r));
+                goto finish_directory;
+        }
+
+        resolver_argv[n_resolver_argv++] = resolver;
+        asprintf(&resolver_argv[n_resolver_argv++], "--varlink=%s", b.address);
+        asprintf(&resolver_argv[n_resolver_argv++], "--config=%s", config);
+        if (threads)
+                resolver_argv[n_resolver_argv++] = threads;
+
+        /* The first start compiles the snapshot, the measured one reads it. */
+        if (use_snapshot) {
+                asprintf(&snapshot, "--snapshot=%s/config.snapshot", b.directory);
+                resolver_argv[n_resolver_argv++] = snapshot;
+
+                r = benchmark_start_resolver(&b, resolver_argv, &pid, &first_resolve);
+                benchmark_stop_resolver(&pid);
+                if (r < 0) {
+                        fprintf(stderr, "Error: %s did not start: %s\n", resolver, strerror(-r));
+                        goto finish_directory;
+                }
+        }
+
+        if (b.n_starts > 0) {
+                r = benchmark_run_startup(&b, resolver_argv, use_snapshot);
+                if (r < 0)
+                        fprintf(stderr, "Error: %s did not start: %s\n", resolver, strerror(-r));
+                else
+                        status = EXIT_SUCCESS;
+
+                goto finish_directory;
+        }
+
+        r = benchmark_start_resolver(&b, resolver_argv, &pid, &first_resolve);
+        if (r < 0) {
+                fprintf(stderr, "Error: %s did not start: %s\n", resolver, strerror(-r));
+                goto finish_resolver;
+        }
+
+        if (b.burst > 0) {
+                r = benchmark_run_burst(&b, pid);
+                if (r < 0)
+                        fprintf(stderr, "Error: burst: %s\n", strerror(-r));
+                else
+                        status = EXIT_SUCCESS;
+
+                goto finish_resolver;
+        }
+
+        clients = calloc(b.n_clients, sizeof(Client));
+        for (unsigned long i = 0; i < b.n_clients; i += 1) {
+                clients[i].benchmark = &b;
+                clients[i].seed = i + 1;
+
+                for (Operation o = 0; o < _OPERATION_MAX; o += 1)
+                        clients[i].latencies[o].samples = calloc(MAX(b.n_requests, 1UL), sizeof(uint64_t));
+        }
+
+        pthread_barrier_init(&b.barrier, NULL, b.n_clients + 1);
+
+        for (unsigned long i = 0; i < b.n_clients; i += 1)
+                pthread_create(&clients[i].thread, NULL, client_run, &clients[i]);
+
+        pthread_barrier_wait(&b.barrier);
+        start = now_usec();
+
+        for (unsigned long i = 0; i < b.n_clients; i += 1)
+                pthread_join(clients[i].thread, NULL);
+
+        printf("%lu services, %lu interfaces each, %lu clients, %lu requests each\n",
+               b.n_services, b.n_interfaces, b.n_clients, b.n_requests);
+        printf("first resolve %llu us after the start, configuration read from %s\n\n",
+               (unsigned long long)first_resolve, use_snapshot ? "the snapshot" : "JSON");
+        benchmark_report(&b, clients, now_usec() - start);
+
+        status = EXIT_SUCCESS;
+        for (unsigned long i = 0; i < b.n_clients; i += 1) {
+                if (clients[i].error < 0) {
+                        fprintf(stderr, "Error: client %lu: %s\n", i, varlink_error_string(-clients[i].error));
+                        status = EXIT_FAILURE;
+                }
+
+                for (Operation o = 0; o < _OPERATION_MAX; o += 1)
+                        free(clients[i].latencies[o].samples);
+        }
+
+        pthread_barrier_destroy(&b.barrier);
+
+finish_resolver:
+        benchmark_stop_resolver(&pid);
+
+finish_directory:
+        remove_directory(b.directory);
+        free(resolver_argv[1]);
+        free(resolver_argv[2]);
+        free(b.address);
+
+        return status;
+}
@@ -0,0 +1,269 @@
+#include "hashmap.h"
+#include "util.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* 64 bit FNV-1a */
+uint64_t string_hash(const char *string) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+
+        for (const unsigned char *p = (const unsigned char *)string; *p; p++) {
+                hash ^= *p;
+                hash *= 0x100000001b3ULL;
+        }
+
+        return hash;
+}
+
+static uint64_t string_hash_func(const void *key) {
+        return string_hash(key);
+}
+
+static bool string_equal_func(const void *key1, const void *key2) {
+        return strcmp(key1, key2) == 0;
+}
+
+const HashOps string_hash_ops = {
+        .hash = string_hash_func,
+        .equal = string_equal_func,
+};
+
+/* Finalizer of MurmurHash3, spreads the bits of small integers. */
+static uint64_t trivial_hash_func(const void *key) {
+        uint64_t hash = (uint64_t)(uintptr_t)key;
+
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+
+        return hash;
+}
+
+static bool trivial_equal_func(const void *key1, const void *key2) {
+        return key1 == key2;
+}
+
+const HashOps trivial_hash_ops = {
+        .hash = trivial_hash_func,
+        .equal = trivial_equal_func,
+};
+
+static uint64_t hashmap_normalize_hash(uint64_t hash) {
+        return hash != 0 ? hash : 1;
+}
+
+static uint64_t hashmap_hash(Hashmap *map, const void *key) {
+        return hashmap_normalize_hash(map->ops->hash(key));
+}
+
+long hashmap_new(Hashmap **mapp, const HashOps *ops) {
+        Hashmap *map;
+
+        map = calloc(1, sizeof(Hashmap));
+        if (!map)
+                return -ENOMEM;
+
+        map->ops = ops;
+
+        *mapp = map;
+
+        return 0;
+}
+
+Hashmap *hashmap_free(Hashmap *map) {
+        free(map->entries);
+        free(map);
+
+        return NULL;
+}
+
+void hashmap_freep(Hashmap **mapp) {
+        if (*mapp)
+                hashmap_free(*mapp);
+}
+
+static HashmapEntry *hashmap_find(Hashmap *map, const void *key, uint64_t hash) {
+        unsigned long mask = map->n_buckets - 1;
+
+        if (map->n_buckets == 0)
+                return NULL;
+
+        for (unsigned long i = hash & mask;; i = (i + 1) & mask) {
+                HashmapEntry *entry = &map->entries[i];
+
+                if (entry->hash == 0)
+                        return NULL;
+
+                if (entry->hash == hash && map->ops->equal(entry->key, key))
+                        return entry;
+        }
+}
+
+static void hashmap_insert(Hashmap *map, uint64_t hash, const void *key, void *value) {
+        unsigned long mask = map->n_buckets - 1;
+        unsigned long i = hash & mask;
+
+        while (map->entries[i].hash != 0)
+                i = (i + 1) & mask;
+
+        map->entries[i].hash = hash;
+        map->entries[i].key = key;
+        map->entries[i].value = value;
+        map->n_entries += 1;
+}
+
+static long hashmap_resize(Hashmap *map, unsigned long n_buckets) {
+        HashmapEntry *entries = map->entries;
+        unsigned long n_buckets_old = map->n_buckets;
+
+        map->entries = calloc(n_buckets, sizeof(HashmapEntry));
+        if (!map->entries) {
+                map->entries = entries;
+                return -ENOMEM;
+        }
+
+        map->n_buckets = n_buckets;
+        map->n_entries = 0;
+
+        for (unsigned long i = 0; i < n_buckets_old; i += 1)
+                if (entries[i].hash != 0)
+                        hashmap_insert(map, entries[i].hash, entries[i].key, entries[i].value);
+
+        free(entries);
+
+        return 0;
+}
+
+long hashmap_copy(Hashmap *map, Hashmap **copyp) {
+        Hashmap *copy;
+
+        copy = calloc(1, sizeof(Hashmap));
+        if (!copy)
+                return -ENOMEM;
+
+        copy->ops = map->ops;
+
+        if (map->n_buckets > 0) {
+                copy->entries = malloc(map->n_buckets * sizeof(HashmapEntry));
+                if (!copy->entries) {
+                        free(copy);
+                        return -ENOMEM;
+                }
+
+                memcpy(copy->entries, map->entries, map->n_buckets * sizeof(HashmapEntry));
+                copy->n_buckets = map->n_buckets;
+                copy->n_entries = map->n_entries;
+        }
+
+        *copyp = copy;
+
+        return 0;
+}
+
+/* Keep the load factor at or below one half, probe sequences stay short. */
+long hashmap_reserve(Hashmap *map, unsigned long n_entries) {
+        unsigned long n_buckets = MAX(map->n_buckets, 16UL);
+
+        while (n_buckets < n_entries * 2)
+                n_buckets *= 2;
+
+        if (n_buckets == map->n_buckets)
+                return 0;
+
+        return hashmap_resize(map, n_buckets);
+}
+
+long hashmap_put(Hashmap *map, const void *key, void *value) {
+        uint64_t hash = hashmap_hash(map, key);
+        long r;
+
+        if (hashmap_find(map, key, hash))
+                return -EEXIST;
+
+        r = hashmap_reserve(map, map->n_entries + 1);
+        if (r < 0)
+                return r;
+
+        hashmap_insert(map, hash, key, value);
+
+        return 0;
+}
+
+void *hashmap_get(Hashmap *map, const void *key) {
+        HashmapEntry *entry;
+
+        entry = hashmap_find(map, key, hashmap_hash(map, key));
+        if (!entry)
+                return NULL;
+
+        return entry->value;
+}
+
+/* For callers which computed the hash of the key with the map's ops already. */
+void *hashmap_get_hashed(Hashmap *map, const void *key, uint64_t hash) {
+        HashmapEntry *entry;
+
+        entry = hashmap_find(map, key, hashmap_normalize_hash(hash));
+        if (!entry)
+                return NULL;
+
+        return entry->value;
+}
+
+void *hashmap_remove(Hashmap *map, const void *key) {
+        unsigned long mask = map->n_buckets - 1;
+        HashmapEntry *entry;
+        unsigned long i;
+        void *value;
+
+        entry = hashmap_find(map, key, hashmap_hash(map, key));
+        if (!entry)
+                return NULL;
+
+        value = entry->value;
+        i = entry - map->entries;
+
+        /*
+         * Shift the following entries of the probe sequence back into the
+         * hole, lookups never need to step over tombstones.
+         */
+        for (unsigned long j = (i + 1) & mask; map->entries[j].hash != 0; j = (j + 1) & mask) {
+                unsigned long home = map->entries[j].hash & mask;
+
+                if (((j - home) & mask) < ((j - i) & mask))
+                        continue;
+
+                map->entries[i] = map->entries[j];
+                i = j;
+        }
+
+        map->entries[i].hash = 0;
+        map->entries[i].key = NULL;
+        map->entries[i].value = NULL;
+        map->n_entries -= 1;
+
+        return value;
+}
+
+bool hashmap_iterate(Hashmap *map, unsigned long *iterator, const void **keyp, void **valuep) {
+        for (unsigned long i = *iterator; i < map->n_buckets; i += 1) {
+                if (map->entries[i].hash == 0)
+                        continue;
+
+                if (keyp)
+                        *keyp = map->entries[i].key;
+                if (valuep)
+                        *valuep = map->entries[i].value;
+
+                *iterator = i + 1;
+
+                return true;
+        }
+
+        *iterator = map->n_buckets;
+
+        return false;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+        uint64_t (*hash)(const void *key);
+        bool (*equal)(const void *key1, const void *key2);
+} HashOps;
+
+/* Keys are NUL-terminated strings, compared by content. */
+extern const HashOps string_hash_ops;
+
+/* Keys are integers stored in the pointer, compared by value. */
+extern const HashOps trivial_hash_ops;
+
+#define INT_TO_PTR(_i) ((void *)(intptr_t)(_i))
+#define PTR_TO_INT(_p) ((int)(intptr_t)(_p))
+
+/*
+ * The stored hash is checked before the key is compared, so a probe
+ * sequence only dereferences a key on a (likely) match. A hash of zero
+ * marks an empty bucket.
+ */
+typedef struct {
+        uint64_t hash;
+        const void *key;
+        void *value;
+} HashmapEntry;
+
+/*
+ * Open addressing hash table with linear probing and backward shift
+ * deletion. Keys are not copied, they must stay valid as long as they
+ * are stored in the map.
+ */
+typedef struct {
+        const HashOps *ops;
+
+        HashmapEntry *entries;
+        unsigned long n_buckets;
+        unsigned long n_entries;
+} Hashmap;
+
+uint64_t string_hash(const char *string);
+
+long hashmap_new(Hashmap **mapp, const HashOps *ops);
+Hashmap *hashmap_free(Hashmap *map);
+void hashmap_freep(Hashmap **mapp);
+long hashmap_copy(Hashmap *map, Hashmap **copyp);
+long hashmap_reserve(Hashmap *map, unsigned long n_entries);
+long hashmap_put(Hashmap *map, const void *key, void *value);
+void *hashmap_get(Hashmap *map, const void *key);
+void *hashmap_get_hashed(Hashmap *map, const void *key, uint64_t hash);
+void *hashmap_remove(Hashmap *map, const void *key);
+bool hashmap_iterate(Hashmap *map, unsigned long *iterator, const void **keyp, void **valuep);
@@ -0,0 +1,353 @@
+#include "interface-index.h"
+#include "util.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* About 0.2% false positives with four probes. */
+#define FILTER_BITS_PER_NAME 16UL
+#define FILTER_PROBES 4
+#define FILTER_BITS_MIN 512UL
+
+/* Double hashing, the probes are derived from both halves of the name's hash. */
+static unsigned long filter_bit(InterfaceIndex *index, uint64_t hash, unsigned long probe) {
+        uint64_t h1 = hash & 0xffffffff;
+        uint64_t h2 = (hash >> 32) | 1;
+
+        return (h1 + probe * h2) & index->filter_mask;
+}
+
+static void filter_add(InterfaceIndex *index, uint64_t hash) {
+        for (unsigned long p = 0; p < FILTER_PROBES; p += 1) {
+                unsigned long bit = filter_bit(index, hash, p);
+
+                index->filter[bit / 64] |= 1ULL << (bit % 64);
+        }
+}
+
+static bool filter_test(InterfaceIndex *index, uint64_t hash) {
+        for (unsigned long p = 0; p < FILTER_PROBES; p += 1) {
+                unsigned long bit = filter_bit(index, hash, p);
+
+                if (!(index->filter[bit / 64] & (1ULL << (bit % 64))))
+                        return false;
+        }
+
+        return true;
+}
+
+static long filter_rebuild(InterfaceIndex *index) {
+        unsigned long n_bits = FILTER_BITS_MIN;
+        unsigned long iterator = 0;
+        const void *name;
+
+        while (n_bits < index->interfaces->n_entries * FILTER_BITS_PER_NAME)
+                n_bits *= 2;
+
+        free(index->filter);
+        index->filter = calloc(n_bits / 64, sizeof(uint64_t));
+        if (!index->filter)
+                return -ENOMEM;
+
+        index->filter_mask = n_bits - 1;
+        index->n_filter_stale = 0;
+
+        while (hashmap_iterate(index->interfaces, &iterator, &name, NULL))
+                filter_add(index, string_hash(name));
+
+        return 0;
+}
+
+static bool name_is_pattern(const char *name) {
+        unsigned long length = strlen(name);
+
+        return length > 2 && strcmp(name + length - 2, ".*") == 0;
+}
+
+static Hashmap *interface_index_map(InterfaceIndex *index, const char *name) {
+        return name_is_pattern(name) ? index->patterns : index->interfaces;
+}
+
+/* Returns true, if the string changed. */
+static bool set_string(char **stringp, const char *str) {
+        bool changed;
+
+        changed = !*stringp != !str || (str && strcmp(*stringp, str) != 0);
+        if (changed) {
+                free(*stringp);
+                *stringp = str ? strdup(str) : NULL;
+        }
+
+        return changed;
+}
+
+/* Returns true and bumps the generation, if one of the strings changed. */
+bool interface_index_set_info(InterfaceIndex *index,
+                              const char *vendor,
+                              const char *product,
+                              const char *version,
+                              const char *url) {
+        bool changed = false;
+
+        changed |= set_string(&index->vendor, vendor);
+        changed |= set_string(&index->product, product);
+        changed |= set_string(&index->version, version);
+        changed |= set_string(&index->url, url);
+
+        if (changed)
+                index->generation += 1;
+
+        return changed;
+}
+
+long interface_index_new(InterfaceIndex **indexp) {
+        _cleanup_(interface_index_freep) InterfaceIndex *index = NULL;
+        long r;
+
+        index = calloc(1, sizeof(InterfaceIndex));
+        if (!index)
+                return -ENOMEM;
+
+        index->generation = 1;
+
+        r = hashmap_new(&index->interfaces, &string_hash_ops);
+        if (r < 0)
+                return r;
+
+        r = hashmap_new(&index->patterns, &string_hash_ops);
+        if (r < 0)
+                return r;
+
+        r = filter_rebuild(index);
+        if (r < 0)
+                return r;
+
+        *indexp = index;
+        index = NULL;
+
+        return 0;
+}
+
+InterfaceIndex *interface_index_free(InterfaceIndex *index) {
+        if (index->interfaces)
+                hashmap_free(index->interfaces);
+        if (index->patterns)
+                hashmap_free(index->patterns);
+
+        free(index->names);
+        free(index->filter);
+        free(index->vendor);
+        free(index->product);
+        free(index->version);
+        free(index->url);
+        free(index);
+
+        return NULL;
+}
+
+void interface_index_freep(InterfaceIndex **indexp) {
+        if (*indexp)
+                interface_index_free(*indexp);
+}
+
+/* The copy has its names sorted already, it can be shared read-only. */
+long interface_index_copy(InterfaceIndex *index, InterfaceIndex **copyp) {
+        _cleanup_(interface_index_freep) InterfaceIndex *copy = NULL;
+        const char **names;
+        unsigned long n_names;
+        long r;
+
+        r = interface_index_get_names(index, &names, &n_names);
+        if (r < 0)
+                return r;
+
+        copy = calloc(1, sizeof(InterfaceIndex));
+        if (!copy)
+                return -ENOMEM;
+
+        copy->generation = index->generation;
+
+        r = hashmap_copy(index->interfaces, &copy->interfaces);
+        if (r < 0)
+                return r;
+
+        r = hashmap_copy(index->patterns, &copy->patterns);
+        if (r < 0)
+                return r;
+
+        copy->names = malloc(MAX(n_names, 1UL) * sizeof(const char *));
+        if (!copy->names)
+                return -ENOMEM;
+
+        memcpy(copy->names, names, n_names * sizeof(const char *));
+        copy->n_names = n_names;
+        copy->names_generation = copy->generation;
+
+        /* The copy gets a filter without stale bits. */
+        r = filter_rebuild(copy);
+        if (r < 0)
+                return r;
+
+        if ((index->vendor && !(copy->vendor = strdup(index->vendor))) ||
+            (index->product && !(copy->product = strdup(index->product))) ||
+            (index->version && !(copy->version = strdup(index->version))) ||
+            (index->url && !(copy->url = strdup(index->url))))
+                return -ENOMEM;
+
+        *copyp = copy;
+        copy = NULL;
+
+        return 0;
+}
+
+void interface_index_remove(InterfaceIndex *index, Service *service) {
+        for (unsigned long i = 0; i < service->n_interfaces; i += 1) {
+                Hashmap *map = interface_index_map(index, service->interfaces[i]);
+
+                if (hashmap_get(map, service->interfaces[i]) != service)
+                        continue;
+
+                hashmap_remove(map, service->interfaces[i]);
+                index->generation += 1;
+
+                if (map == index->interfaces)
+                        index->n_filter_stale += 1;
+        }
+
+        /* A failed rebuild leaves no filter, lookups still work, only slower. */
+        if (index->filter && index->n_filter_stale > index->interfaces->n_entries + FILTER_BITS_MIN / FILTER_BITS_PER_NAME)
+                filter_rebuild(index);
+}
+
+/*
+ * Only the interfaces of the given service are touched. An interface
+ * which is already provided by another service fails the whole service,
+ * the entries added so far are removed again.
+ */
+long interface_index_add(InterfaceIndex *index, Service *service) {
+        long r;
+
+        r = hashmap_reserve(index->interfaces, index->interfaces->n_entries + service->n_interfaces);
+        if (r < 0)
+                return r;
+
+        for (unsigned long i = 0; i < service->n_interfaces; i += 1) {
+                Hashmap *map = interface_index_map(index, service->interfaces[i]);
+
+                r = hashmap_put(map, service->interfaces[i], service);
+                if (r < 0) {
+                        interface_index_remove(index, service);
+
+                        return r == -EEXIST ? -ENOTUNIQ : r;
+                }
+
+                index->generation += 1;
+
+                if (map == index->interfaces && index->filter)
+                        filter_add(index, string_hash(service->interfaces[i]));
+        }
+
+        /* Grow the filter with the index, or try again to allocate one. */
+        if (!index->filter ||
+            index->interfaces->n_entries * FILTER_BITS_PER_NAME > index->filter_mask + 1)
+                filter_rebuild(index);
+
+        return 0;
+}
+
+/*
+ * Tries the patterns for every namespace of the name, starting with the
+ * longest one. The cost depends on the depth of the name, not on the
+ * number of patterns.
+ */
+static Service *interface_index_lookup_pattern(InterfaceIndex *index, const char *name) {
+        char buffer[256];
+        _cleanup_(freep) char *allocated = NULL;
+        unsigned long length = strlen(name);
+        char *pattern = buffer;
+
+        if (length + 2 > sizeof(buffer)) {
+                allocated = malloc(length + 2);
+                if (!allocated)
+                        return NULL;
+
+                pattern = allocated;
+        }
+
+        memcpy(pattern, name, length + 1);
+
+        /* Cut the name after each dot from the right, the prefix before it stays intact. */
+        for (unsigned long i = length; i > 0; i -= 1) {
+                Service *service;
+
+                if (name[i - 1] != '.' || i == length)
+                        continue;
+
+                pattern[i] = '*';
+                pattern[i + 1] = '\0';
+
+                service = hashmap_get(index->patterns, pattern);
+                if (service)
+                        return service;
+        }
+
+        return NULL;
+}
+
+/* Sets *rejectedp, if the name was rejected by the filter without an exact lookup. */
+Service *interface_index_lookup(InterfaceIndex *index, const char *name, bool *rejectedp) {
+        uint64_t hash = string_hash(name);
+        Service *service = NULL;
+
+        *rejectedp = index->filter && !filter_test(index, hash);
+        if (!*rejectedp)
+                service = hashmap_get_hashed(index->interfaces, name, hash);
+
+        if (!service && index->patterns->n_entries > 0)
+                service = interface_index_lookup_pattern(index, name);
+
+        return service;
+}
+
+static int names_compare(const void *p1, const void *p2) {
+        const char *name1 = *(const char **)p1;
+        const char *name2 = *(const char **)p2;
+
+        return strcmp(name1, name2);
+}
+
+long interface_index_get_names(InterfaceIndex *index, const char ***namesp, unsigned long *n_namesp) {
+        if (index->names_generation != index->generation) {
+                const char **names;
+                unsigned long n_names = 0;
+                unsigned long iterator = 0;
+                const void *name;
+
+                names = realloc(index->names,
+                                MAX(index->interfaces->n_entries + index->patterns->n_entries, 1UL) * sizeof(const char *));
+                if (!names)
+                        return -ENOMEM;
+
+                while (hashmap_iterate(index->interfaces, &iterator, &name, NULL)) {
+                        names[n_names] = name;
+                        n_names += 1;
+                }
+
+                iterator = 0;
+                while (hashmap_iterate(index->patterns, &iterator, &name, NULL)) {
+                        names[n_names] = name;
+                        n_names += 1;
+                }
+
+                qsort(names, n_names, sizeof(const char *), names_compare);
+
+                index->names = names;
+                index->n_names = n_names;
+                index->names_generation = index->generation;
+        }
+
+        *namesp = index->names;
+        *n_namesp = index->n_names;
+
+        return 0;
+}
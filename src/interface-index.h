@@ -0,0 +1,63 @@
+#pragma once
+
+#include "hashmap.h"
+#include "service.h"
+
+#include <stdint.h>
+
+/*
+ * Maps interface names to the Service providing them. The names are not
+ * copied, they point into the Service.
+ *
+ * A name ending in ".*" is a pattern for all interfaces in its namespace,
+ * "com.example.storage.*" matches "com.example.storage.block.Volume".
+ * An exact name wins over a pattern, the longest matching pattern wins
+ * over shorter ones.
+ */
+typedef struct {
+        Hashmap *interfaces;
+
+        /* Patterns, including the trailing ".*". */
+        Hashmap *patterns;
+
+        /* Bumped with every change of the index. */
+        uint64_t generation;
+
+        /* Sorted interface names, rebuilt on demand. */
+        const char **names;
+        unsigned long n_names;
+        uint64_t names_generation;
+
+        /*
+         * Bloom filter over the hashes of the names, rejects most unknown
+         * names without probing the hashmap. Removed names keep their bits
+         * until the filter is rebuilt. Without a filter, every lookup goes
+         * to the hashmap.
+         */
+        uint64_t *filter;
+        unsigned long filter_mask;
+        unsigned long n_filter_stale;
+
+        /*
+         * Returned by GetInfo. They are owned by the index and copied
+         * with it, workers read them from the published copy.
+         */
+        char *vendor;
+        char *product;
+        char *version;
+        char *url;
+} InterfaceIndex;
+
+long interface_index_new(InterfaceIndex **indexp);
+InterfaceIndex *interface_index_free(InterfaceIndex *index);
+void interface_index_freep(InterfaceIndex **indexp);
+long interface_index_copy(InterfaceIndex *index, InterfaceIndex **copyp);
+long interface_index_add(InterfaceIndex *index, Service *service);
+void interface_index_remove(InterfaceIndex *index, Service *service);
+Service *interface_index_lookup(InterfaceIndex *index, const char *name, bool *rejectedp);
+bool interface_index_set_info(InterfaceIndex *index,
+                              const char *vendor,
+                              const char *product,
+                              const char *version,
+                              const char *url);
+long interface_index_get_names(InterfaceIndex *index, const char ***namesp, unsigned long *n_namesp);
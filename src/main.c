@@ -1,16 +1,32 @@
+#include "hashmap.h"
+#include "interface-index.h"
+#include "prioq.h"
+#include "rcu.h"
 #include "service.h"
+#include "snapshot.h"
+#include "spawner.h"
+#include "stats.h"
+#include "subscription.h"
 #include "util.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <varlink.h>
@@ -18,52 +34,291 @@
 #include "com.redhat.resolver.varlink.c.inc"
 #include "org.varlink.resolver.varlink.c.inc"
 
+#define RESTART_BACKOFF_MIN_USEC (1 * USEC_PER_SEC)
+#define RESTART_BACKOFF_MAX_USEC (300 * USEC_PER_SEC)
+#define WORKERS_MAX 64
+#define SPAWNERS_MAX 64
+
+/* Resolves within this time of the last recorded one do not write to the service. */
+#define USED_GRANULARITY_USEC (USEC_PER_SEC / 10)
+
+/*
+ * The listen queue of a service which may start more instances is
+ * sampled at this interval. A connection waiting at consecutive samples
+ * starts another instance.
+ */
+#define PRESSURE_INTERVAL_USEC (USEC_PER_SEC / 4)
+#define PRESSURE_SAMPLES 2
+
 typedef struct {
-        const char *name;
-        Service *service;
-} Interface;
+        VarlinkObject *reply;
+        uint64_t generation;
+} ReplyCache;
+
+/*
+ * A thread serving varlink calls on its own VarlinkService, accepting
+ * connections from the same listen socket as the main thread.
+ */
+typedef struct {
+        pthread_t thread;
+        VarlinkService *service;
+        int epoll_fd;
+        int exit_fd;
+        int failed_fd;
+        RcuReader rcu;
+        ReplyCache info_cache;
+
+        /* Signaled after every change of the published index. */
+        int notify_fd;
+        InterfaceIndex **published;
+        SubscriptionList subscriptions;
+
+        /* The counters of resolves handled by this worker, see manager_get_stats(). */
+        Stats stats;
+} Worker;
+
+/* The worker running the current call, NULL in the main thread. */
+static __thread Worker *current_worker;
 
 typedef struct {
         VarlinkService *service;
+        int listen_fd;
+        char *path_to_unlink;
+
+        /* Our own binary and command line, to execute it again on SIGUSR2. */
+        char *executable;
+        char **argv;
+        bool reexec;
+
+        /*
+         * Held by the main thread while it handles events, and by workers
+         * for calls which read or change the services.
+         */
+        pthread_mutex_t lock;
+
+        Worker *workers;
+        unsigned long n_workers;
+        int exit_fd;
+
+        /* Written by a worker which stopped on an error, that is fatal like in the main loop. */
+        int failed_fd;
 
         int epoll_fd;
         int signal_fd;
-
-        char *vendor;
-        char *product;
-        char *version;
-        char *url;
+        int timer_fd;
+
+        /* The configuration file, reloaded on SIGHUP and when it changed. */
+        char *config;
+        const char *config_name;
+        int inotify_fd;
+
+        /* The compiled configuration, written after every successful load. */
+        char *snapshot;
+
+        /* Pre-forked children, refilled after every batch of events. */
+        Spawner **spawners;
+        unsigned long n_spawners;
+        unsigned long n_spawners_max;
+        char **spawn_envp;
+        unsigned long n_spawn_envp;
+        int zygote_fd;
+
+        /*
+         * Receives the sd_notify() messages of the services, READY=1 marks
+         * an instance as ready. The NOTIFY_SOCKET= entry of their
+         * environment is NULL, if the socket could not be opened.
+         */
+        int ready_fd;
+        char *ready_socket;
+
+        /* Subscriptions of calls to the main thread, notified by notify_fd. */
+        int notify_fd;
+        SubscriptionList subscriptions;
+        uint64_t notified_generation;
 
         Service **services;
         unsigned long n_services;
         unsigned long n_services_allocated;
 
-        Interface *interfaces;
-        unsigned long n_interfaces;
+        /* Service address -> Service */
+        Hashmap *addresses;
+
+        /* Process ID -> ServiceInstance, for running instances */
+        Hashmap *pids;
+
+        /* Failed instances, ordered by the time they may be started again. */
+        Prioq *restarts;
+
+        /* Running services with an idle policy, ordered by the time they might be stopped. */
+        Prioq *idle;
+
+        /* Running services which may start more instances, ordered by the next sample of their listen queue. */
+        Prioq *pressure;
+
+        /*
+         * Above this number of running services, the least recently used
+         * one is stopped. A service counts once, with all its instances.
+         */
+        unsigned long n_running_max;
+
+        /* Removed services, freed after the current batch of events. */
+        Service **retired;
+        unsigned long n_retired;
+        unsigned long n_retired_allocated;
+
+        /* Interface name -> Service, only used by the main thread. */
+        InterfaceIndex *index;
+
+        /*
+         * A read-only copy of the index for the workers. It is replaced
+         * after every change, the old copy is freed when no worker
+         * reads from it anymore.
+         */
+        InterfaceIndex *published;
+
+        /*
+         * Bumped with every change of the set of services. The replies
+         * of GetInfo and GetConfig are built once per generation.
+         */
+        uint64_t generation;
+        ReplyCache info_cache;
+        ReplyCache config_cache;
+
+        /*
+         * The main thread counts its resolves here itself, the workers
+         * in their own copy. Every service counts resolves in a slot for
+         * every thread.
+         */
+        Stats stats;
+        unsigned long n_threads;
 
         sigset_t oldmask;
 } Manager;
 
+static void reply_cache_clear(ReplyCache *cache) {
+        if (cache->reply)
+                cache->reply = varlink_object_unref(cache->reply);
+
+        cache->generation = 0;
+}
+
+static void worker_clear(Worker *w) {
+        subscription_list_clear(&w->subscriptions);
+
+        if (w->service)
+                w->service = varlink_service_free(w->service);
+
+        if (w->notify_fd >= 0) {
+                close(w->notify_fd);
+                w->notify_fd = -1;
+        }
+
+        if (w->epoll_fd >= 0) {
+                close(w->epoll_fd);
+                w->epoll_fd = -1;
+        }
+
+        reply_cache_clear(&w->info_cache);
+}
+
+static void manager_stop_workers(Manager *m) {
+        if (m->exit_fd >= 0)
+                eventfd_write(m->exit_fd, 1);
+
+        for (unsigned long i = 0; i < m->n_workers; i += 1) {
+                pthread_join(m->workers[i].thread, NULL);
+                worker_clear(&m->workers[i]);
+        }
+
+        free(m->workers);
+        m->workers = NULL;
+        m->n_workers = 0;
+}
+
+static void manager_free_retired(Manager *m) {
+        for (unsigned long i = 0; i < m->n_retired; i += 1)
+                service_free(m->retired[i]);
+
+        m->n_retired = 0;
+}
+
 static void manager_free(Manager *m) {
+        manager_stop_workers(m);
+
+        if (m->exit_fd >= 0)
+                close(m->exit_fd);
+
+        if (m->failed_fd >= 0)
+                close(m->failed_fd);
+
+        if (m->restarts)
+                prioq_free(m->restarts);
+        if (m->idle)
+                prioq_free(m->idle);
+        if (m->pressure)
+                prioq_free(m->pressure);
+
+        for (unsigned long i = 0; i < m->n_spawners; i += 1)
+                spawner_free(m->spawners[i]);
+        free(m->spawners);
+        free(m->spawn_envp);
+
+        if (m->zygote_fd >= 0)
+                close(m->zygote_fd);
+
         for (unsigned long i = 0; i < m->n_services; i += 1)
                 service_free(m->services[i]);
         free(m->services);
 
+        manager_free_retired(m);
+        free(m->retired);
+
         if (m->epoll_fd >= 0)
                 close(m->epoll_fd);
 
         if (m->signal_fd >= 0)
                 close(m->signal_fd);
 
-        free(m->vendor);
-        free(m->product);
-        free(m->version);
-        free(m->url);
+        if (m->timer_fd >= 0)
+                close(m->timer_fd);
+
+        if (m->notify_fd >= 0)
+                close(m->notify_fd);
+
+        if (m->inotify_fd >= 0)
+                close(m->inotify_fd);
+
+        if (m->ready_fd >= 0)
+                close(m->ready_fd);
+        free(m->ready_socket);
+
+        free(m->config);
+        free(m->snapshot);
+        free(m->executable);
+
+        subscription_list_clear(&m->subscriptions);
 
         if (m->service)
                 varlink_service_free(m->service);
 
-        free(m->interfaces);
+        if (m->path_to_unlink) {
+                unlink(m->path_to_unlink);
+                free(m->path_to_unlink);
+        }
+
+        if (m->pids)
+                hashmap_free(m->pids);
+        if (m->addresses)
+                hashmap_free(m->addresses);
+        if (m->published)
+                interface_index_free(m->published);
+        if (m->index)
+                interface_index_free(m->index);
+
+        reply_cache_clear(&m->info_cache);
+        reply_cache_clear(&m->config_cache);
+
+        pthread_mutex_destroy(&m->lock);
 
         free(m);
 }
@@ -75,10 +330,53 @@ static void manager_freep(Manager **mp) {
 
 static long manager_new(Manager **mp) {
         _cleanup_(manager_freep) Manager *m = NULL;
+        pthread_mutexattr_t attr;
+        long r;
 
         m = calloc(1, sizeof(Manager));
         m->epoll_fd = -1;
         m->signal_fd = -1;
+        m->timer_fd = -1;
+        m->exit_fd = -1;
+        m->failed_fd = -1;
+        m->notify_fd = -1;
+        m->inotify_fd = -1;
+        m->ready_fd = -1;
+        m->zygote_fd = -1;
+        m->listen_fd = -1;
+        m->generation = 1;
+        m->stats.start_usec = now_usec();
+        m->n_threads = 1;
+
+        /* Calls handled by the main thread take the lock it already holds. */
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&m->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        r = hashmap_new(&m->addresses, &string_hash_ops);
+        if (r < 0)
+                return r;
+
+        r = hashmap_new(&m->pids, &trivial_hash_ops);
+        if (r < 0)
+                return r;
+
+        r = prioq_new(&m->restarts);
+        if (r < 0)
+                return r;
+
+        r = prioq_new(&m->idle);
+        if (r < 0)
+                return r;
+
+        r = prioq_new(&m->pressure);
+        if (r < 0)
+                return r;
+
+        r = interface_index_new(&m->index);
+        if (r < 0)
+                return r;
 
         *mp = m;
         m = NULL;
@@ -89,24 +387,150 @@ static long manager_new(Manager **mp) {
 static long manager_watch_service(Manager *m, Service *service) {
         struct epoll_event ev = {};
 
+        if (service->watched)
+                return 0;
+
         ev.events = EPOLLIN;
-        ev.data.ptr = service;
+        ev.data.ptr = &service->listen_watch;
         if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, service->listen_fd, &ev) < 0)
                 return -errno;
 
+        service->watched = true;
+
         return 0;
 }
 
 static long manager_unwatch_service(Manager *m, Service *service) {
+        if (!service->watched)
+                return 0;
+
+        service->watched = false;
+
         if (epoll_ctl(m->epoll_fd, EPOLL_CTL_DEL, service->listen_fd, NULL) < 0)
                 return -errno;
 
         return 0;
 }
 
+/* The listen socket is watched while a connection may activate the service. */
+static long manager_update_watch(Manager *m, Service *service) {
+        if (service_can_activate(service))
+                return manager_watch_service(m, service);
+
+        return manager_unwatch_service(m, service);
+}
+
+static void manager_unindex_service(Manager *m, Service *service) {
+        if (hashmap_get(m->addresses, service->address) == service)
+                hashmap_remove(m->addresses, service->address);
+
+        interface_index_remove(m->index, service);
+}
+
+/*
+ * Only the address and the interfaces of the given service are touched.
+ * An address or interface which is already provided by another service
+ * fails the whole service, the entries added so far are removed again.
+ */
+static long manager_index_service(Manager *m, Service *service) {
+        long r;
+
+        r = hashmap_put(m->addresses, service->address, service);
+        if (r < 0)
+                return r == -EEXIST ? -ENOTUNIQ : r;
+
+        r = interface_index_add(m->index, service);
+        if (r < 0) {
+                hashmap_remove(m->addresses, service->address);
+                return r;
+        }
+
+        return 0;
+}
+
+/*
+ * Hands a copy of the changed index over to the workers. Returns when
+ * no worker reads from the previous copy anymore, and frees it.
+ */
+static long manager_publish_index(Manager *m) {
+        InterfaceIndex *index;
+        long r;
+
+        if (!m->workers)
+                return 0;
+
+        if (m->published && m->published->generation == m->index->generation)
+                return 0;
+
+        r = interface_index_copy(m->index, &index);
+        if (r < 0)
+                return r;
+
+        index = __atomic_exchange_n(&m->published, index, __ATOMIC_SEQ_CST);
+
+        for (unsigned long i = 0; i < m->n_workers; i += 1)
+                rcu_wait_for_reader(&m->workers[i].rcu);
+
+        if (index)
+                interface_index_free(index);
+
+        return 0;
+}
+
+/* Publishes the index to the workers, and lets every thread notify its subscriptions. */
+static long manager_index_changed(Manager *m) {
+        long r;
+
+        if (m->notified_generation == m->index->generation)
+                return 0;
+
+        r = manager_publish_index(m);
+        if (r < 0)
+                return r;
+
+        m->notified_generation = m->index->generation;
+
+        if (m->notify_fd >= 0)
+                eventfd_write(m->notify_fd, 1);
+
+        for (unsigned long i = 0; i < m->n_workers; i += 1)
+                eventfd_write(m->workers[i].notify_fd, 1);
+
+        return 0;
+}
+
+/* The index to read from, callers in workers must be in a read-side section. */
+static InterfaceIndex *manager_get_index(Manager *m) {
+        if (current_worker)
+                return __atomic_load_n(&m->published, __ATOMIC_SEQ_CST);
+
+        return m->index;
+}
+
 static long manager_add_service(Manager *m, Service *service) {
         long r;
 
+        if (!service->stats.resolves) {
+                service->stats.resolves = aligned_alloc(sizeof(CounterShard), m->n_threads * sizeof(CounterShard));
+                if (!service->stats.resolves)
+                        return -ENOMEM;
+
+                memset(service->stats.resolves, 0, m->n_threads * sizeof(CounterShard));
+                service->stats.n_resolve_shards = m->n_threads;
+        }
+
+        r = manager_index_service(m, service);
+        if (r < 0)
+                return r;
+
+        if (service->executable) {
+                r = manager_watch_service(m, service);
+                if (r < 0) {
+                        manager_unindex_service(m, service);
+                        return r;
+                }
+        }
+
         if (m->n_services == m->n_services_allocated) {
                 m->n_services_allocated = MAX(m->n_services_allocated * 2, 8);
                 m->services = realloc(m->services, m->n_services_allocated * sizeof(Service *));
@@ -115,17 +539,28 @@ static long manager_add_service(Manager *m, Service *service) {
         service->index = m->n_services;
         m->services[m->n_services] = service;
         m->n_services += 1;
-
-        if (service->executable) {
-                r = manager_watch_service(m, service);
-                if (r < 0)
-                        return r;
-        }
+        m->generation += 1;
 
         return 0;
 }
 
+/*
+ * The service is stopped right away, but freed only after the current
+ * batch of events, which might still refer to it.
+ */
 static long manager_remove_service(Manager *m, Service *service) {
+        if (m->n_retired == m->n_retired_allocated) {
+                unsigned long n_retired_allocated = MAX(m->n_retired_allocated * 2, 8UL);
+                Service **retired;
+
+                retired = realloc(m->retired, n_retired_allocated * sizeof(Service *));
+                if (!retired)
+                        return -ENOMEM;
+
+                m->retired = retired;
+                m->n_retired_allocated = n_retired_allocated;
+        }
+
         /* Move last service to current slot */
         if (service->index + 1 < m->n_services) {
                 m->services[service->index] = m->services[m->n_services - 1];
@@ -133,94 +568,85 @@ static long manager_remove_service(Manager *m, Service *service) {
         }
 
         m->n_services -= 1;
-        manager_unwatch_service(m, service);
-        service_free(service);
+        m->generation += 1;
+        for (unsigned long i = 0; i < service->n_instances_max; i += 1) {
+                ServiceInstance *instance = &service->instances[i];
 
-        return 0;
-}
+                if (instance->pid > 0)
+                        hashmap_remove(m->pids, INT_TO_PTR(instance->pid));
+                prioq_remove(m->restarts, &instance->restart_index);
+        }
+        prioq_remove(m->idle, &service->idle_index);
+        prioq_remove(m->pressure, &service->pressure_index);
+        manager_unindex_service(m, service);
+        manager_unwatch_service(m, service);
+        service_stop(service);
+        service->removed = true;
 
-static int interfaces_compare(const void *p1, const void *p2) {
-        Interface *i1 = (Interface *)p1;
-        Interface *i2 = (Interface *)p2;
+        m->retired[m->n_retired] = service;
+        m->n_retired += 1;
 
-        return strcmp(i1->name, i2->name);
+        return 0;
 }
 
-static long manager_update_interface_index(Manager *m) {
-        unsigned long n_interfaces_allocated = 0;
-
-        m->n_interfaces = 0;
-        free(m->interfaces);
-        m->interfaces = NULL;
-
-        for (unsigned long s = 0; s < m->n_services; s += 1) {
-                Service *service = m->services[s];
-
-                for (unsigned long i = 0; i < service->n_interfaces; i += 1) {
-                        if (m->n_interfaces == n_interfaces_allocated) {
-                                n_interfaces_allocated = MAX(n_interfaces_allocated * 2, 8);
-                                m->interfaces = realloc(m->interfaces, n_interfaces_allocated * sizeof(Interface));
-                        }
+static long manager_find_instance_by_pid(Manager *m, ServiceInstance **instancep, pid_t pid) {
+        ServiceInstance *instance;
 
-                        m->interfaces[m->n_interfaces].name = service->interfaces[i];
-                        m->interfaces[m->n_interfaces].service = service;
-                        m->n_interfaces += 1;
-                }
-        }
+        assert(pid > 0);
 
-        qsort(m->interfaces, m->n_interfaces, sizeof(Interface), interfaces_compare);
+        instance = hashmap_get(m->pids, INT_TO_PTR(pid));
+        if (!instance)
+                return -ESRCH;
 
-        /* Check for duplicates. */
-        for (unsigned long i = 0; i + 1 < m->n_interfaces; i += 1)
-                if (strcmp(m->interfaces[i].name, m->interfaces[i + 1].name) == 0)
-                        return -ENOTUNIQ;
+        *instancep = instance;
 
         return 0;
 }
 
-static long manager_find_service_by_interface(Manager *m, const char *interface_name, Service **servicep) {
-        Interface interf = {
-                .name = (char *)interface_name,
-        };
-        Interface *interface;
+static long manager_find_service_by_address(Manager *m, Service **servicep, const char *address) {
+        Service *service;
 
-        interface = bsearch(&interf, m->interfaces, m->n_interfaces, sizeof(Interface), interfaces_compare);
-        if (!interface)
+        service = hashmap_get(m->addresses, address);
+        if (!service)
                 return -ESRCH;
 
-        *servicep = interface->service;
+        *servicep = service;
 
         return 0;
 }
 
-static long manager_find_service_by_pid(Manager *m, Service **servicep, pid_t pid) {
-        assert(pid > 0);
-
-        for (unsigned long i = 0; i < m->n_services; i += 1) {
-                Service *service = m->services[i];
+/*
+ * The stats of the calling thread. Only that thread writes them, no
+ * other thread shares their cache lines.
+ */
+static Stats *manager_get_stats(Manager *m) {
+        return current_worker ? &current_worker->stats : &m->stats;
+}
 
-                if (service->pid == pid) {
-                        *servicep = service;
+/* Looks up a single interface, counts the result and marks the service as used. */
+static Service *manager_resolve(Manager *m, InterfaceIndex *index, const char *interface_name, uint64_t now) {
+        Stats *stats = manager_get_stats(m);
+        Service *service;
+        bool rejected;
+        uint64_t used;
 
-                        return 0;
-                }
-        }
+        counter_inc_owned(&stats->n_resolves);
 
-        return -ESRCH;
-}
+        service = interface_index_lookup(index, interface_name, &rejected);
+        if (!service) {
+                counter_inc_owned(&stats->n_resolve_misses);
+                counter_inc_owned(rejected ? &stats->n_filter_rejects : &stats->n_filter_false_positives);
 
-static long manager_find_service_by_address(Manager *m, Service **servicep, const char *address) {
-        for (unsigned long i = 0; i < m->n_services; i += 1) {
-                Service *service = m->services[i];
+                return NULL;
+        }
 
-                if (strcmp(service->address, address) == 0) {
-                        *servicep = service;
+        counter_inc_owned(&service->stats.resolves[current_worker ? current_worker - m->workers + 1 : 0].value);
 
-                        return 0;
-                }
-        }
+        used = __atomic_load_n(&service->used_usec, __ATOMIC_RELAXED);
+        if (now > used + USED_GRANULARITY_USEC)
+                __atomic_store_n(&service->used_usec, now, __ATOMIC_RELAXED);
 
-        return -ESRCH;
+        return service;
 }
 
 static long org_varlink_resolver_Resolve(VarlinkService *resolver_service,
@@ -229,79 +655,154 @@ static long org_varlink_resolver_Resolve(VarlinkService *resolver_service,
                                          uint64_t flags,
                                          void *userdata) {
         Manager *m = userdata;
+        Stats *stats = manager_get_stats(m);
         const char *interface_name = NULL;
         Service *service;
         _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+        uint64_t start = now_usec();
         long r;
 
         r = varlink_object_get_string(parameters, "interface", &interface_name);
         if (r < 0)
                 return varlink_call_reply_invalid_parameter(call, "interface");
 
-        r = manager_find_service_by_interface(m, interface_name, &service);
-        if (r < 0) {
-                switch (r) {
-                        case -ESRCH:
-                                return varlink_call_reply_error(call, "org.varlink.resolver.InterfaceNotFound", NULL);
+        if (current_worker)
+                rcu_read_lock(&current_worker->rcu);
 
-                        default:
-                                return r;
-                }
+        service = manager_resolve(m, manager_get_index(m), interface_name, start);
+        if (service) {
+                varlink_object_new(&out);
+                varlink_object_set_string(out, "address", service->address);
+        }
+
+        if (current_worker)
+                rcu_read_unlock(&current_worker->rcu);
+
+        if (!service)
+                r = varlink_call_reply_error(call, "org.varlink.resolver.InterfaceNotFound", NULL);
+        else
+                r = varlink_call_reply(call, out, 0);
+
+        histogram_add_owned(&stats->resolve, now_usec() - start);
+        stats_first_resolve(stats);
+
+        return r;
+}
+
+/*
+ * Resolves all interfaces in one call, from the same version of the
+ * index. Unknown interfaces are left out of the reply.
+ */
+static long com_redhat_resolver_ResolveMany(VarlinkService *resolver_service,
+                                              VarlinkCall *call,
+                                              VarlinkObject *parameters,
+                                              uint64_t flags,
+                                              void *userdata) {
+        Manager *m = userdata;
+        VarlinkArray *interfacesv;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *addresses = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+        InterfaceIndex *index;
+        long n_interfaces;
+        uint64_t now = now_usec();
+        long r = 0;
+
+        if (varlink_object_get_array(parameters, "interfaces", &interfacesv) < 0)
+                return varlink_call_reply_invalid_parameter(call, "interfaces");
+
+        n_interfaces = varlink_array_get_n_elements(interfacesv);
+        if (n_interfaces < 0)
+                return varlink_call_reply_invalid_parameter(call, "interfaces");
+
+        varlink_object_new(&addresses);
+
+        if (current_worker)
+                rcu_read_lock(&current_worker->rcu);
+
+        index = manager_get_index(m);
+        for (long i = 0; i < n_interfaces; i += 1) {
+                const char *interface_name;
+                Service *service;
+
+                r = varlink_array_get_string(interfacesv, i, &interface_name);
+                if (r < 0)
+                        break;
+
+                service = manager_resolve(m, index, interface_name, now);
+                if (service)
+                        varlink_object_set_string(addresses, interface_name, service->address);
         }
 
+        if (current_worker)
+                rcu_read_unlock(&current_worker->rcu);
+
+        if (r < 0)
+                return varlink_call_reply_invalid_parameter(call, "interfaces");
+
         varlink_object_new(&out);
-        varlink_object_set_string(out, "address", service->address);
+        varlink_object_set_object(out, "addresses", addresses);
+
+        r = varlink_call_reply(call, out, 0);
+        stats_first_resolve(manager_get_stats(m));
 
-        return varlink_call_reply(call, out, 0);
+        return r;
 }
 
-static long com_redhat_resolver_GetConfig(VarlinkService *resolver_service,
+/*
+ * Replies with the addresses of the interfaces, and with "more" again
+ * with the changed ones after every change of the services.
+ */
+static long com_redhat_resolver_Subscribe(VarlinkService *resolver_service,
                                             VarlinkCall *call,
                                             VarlinkObject *parameters,
                                             uint64_t flags,
                                             void *userdata) {
         Manager *m = userdata;
+        SubscriptionList *subscriptions = current_worker ? &current_worker->subscriptions : &m->subscriptions;
+        VarlinkArray *interfacesv;
+        long r;
+
+        if (varlink_object_get_array(parameters, "interfaces", &interfacesv) < 0)
+                return varlink_call_reply_invalid_parameter(call, "interfaces");
+
+        if (current_worker)
+                rcu_read_lock(&current_worker->rcu);
+
+        r = subscription_list_add(subscriptions, call, interfacesv, flags, manager_get_index(m));
+
+        if (current_worker)
+                rcu_read_unlock(&current_worker->rcu);
+
+        if (r == -EINVAL)
+                return varlink_call_reply_invalid_parameter(call, "interfaces");
+
+        return r;
+}
+
+static long manager_build_config(Manager *m, VarlinkObject **configp) {
         _cleanup_(varlink_array_unrefp) VarlinkArray *servicesv = NULL;
         _cleanup_(varlink_object_unrefp) VarlinkObject *configv = NULL;
         long r;
 
         varlink_object_new(&configv);
 
-        if (m->vendor)
-                varlink_object_set_string(configv, "vendor", m->vendor);
-        if (m->product)
-                varlink_object_set_string(configv, "product", m->product);
-        if (m->version)
-                varlink_object_set_string(configv, "version", m->version);
-        if (m->url)
-                varlink_object_set_string(configv, "url", m->url);
+        if (m->index->vendor)
+                varlink_object_set_string(configv, "vendor", m->index->vendor);
+        if (m->index->product)
+                varlink_object_set_string(configv, "product", m->index->product);
+        if (m->index->version)
+                varlink_object_set_string(configv, "version", m->index->version);
+        if (m->index->url)
+                varlink_object_set_string(configv, "url", m->index->url);
 
         varlink_array_new(&servicesv);
         for (unsigned long s = 0; s < m->n_services; s += 1) {
                 Service *service = m->services[s];
                 _cleanup_(varlink_object_unrefp) VarlinkObject *servicev = NULL;
-                _cleanup_(varlink_array_unrefp) VarlinkArray *interfacesv = NULL;
-                _cleanup_(varlink_object_unrefp) VarlinkObject *executablev = NULL;
 
-                varlink_array_new(&interfacesv);
-
-                for (unsigned long i = 0; i < service->n_interfaces; i += 1) {
-                        r = varlink_array_append_string(interfacesv, service->interfaces[i]);
-                        if (r < 0)
-                                return r;
-                }
-
-                varlink_object_new(&executablev);
-                if (service->executable)
-                        varlink_object_set_string(executablev, "path", service->executable);
-                varlink_object_set_int(executablev, "user_id", service->uid);
-                varlink_object_set_int(executablev, "group_id", service->gid);
-
-                varlink_object_new(&servicev);
-                varlink_object_set_string(servicev, "address", service->address);
-                varlink_object_set_array(servicev, "interfaces", interfacesv);
-                varlink_object_set_object(servicev, "executable", executablev);
-                varlink_object_set_bool(servicev, "activate_at_startup", service->activate_at_startup);
+                r = service_to_object(service, &servicev);
+                if (r < 0)
+                        return r;
 
                 r = varlink_array_append_object(servicesv, servicev);
                 if (r < 0)
@@ -310,293 +811,2121 @@ static long com_redhat_resolver_GetConfig(VarlinkService *resolver_service,
 
         varlink_object_set_array(configv, "services", servicesv);
 
-        return varlink_call_reply(call, configv, 0);
+        *configp = configv;
+        configv = NULL;
+
+        return 0;
 }
 
-static long org_varlink_resolver_GetInfo(VarlinkService *service,
-                                         VarlinkCall *call,
-                                         VarlinkObject *parameters,
-                                         uint64_t flags,
-                                         void *userdata) {
+static long com_redhat_resolver_GetConfig(VarlinkService *resolver_service,
+                                            VarlinkCall *call,
+                                            VarlinkObject *parameters,
+                                            uint64_t flags,
+                                            void *userdata) {
         Manager *m = userdata;
-        _cleanup_(varlink_object_unrefp) VarlinkObject *reply = NULL;
-        _cleanup_(varlink_array_unrefp) VarlinkArray *interfaces = NULL;
+        long r = 0;
 
-        varlink_object_new(&reply);
+        pthread_mutex_lock(&m->lock);
 
-        if (m->vendor)
-                varlink_object_set_string(reply, "vendor", m->vendor);
-        if (m->product)
-                varlink_object_set_string(reply, "product", m->product);
-        if (m->version)
-                varlink_object_set_string(reply, "version", m->version);
-        if (m->url)
-                varlink_object_set_string(reply, "url", m->url);
+        if (m->config_cache.generation != m->generation) {
+                reply_cache_clear(&m->config_cache);
 
-        varlink_array_new(&interfaces);
-        for (unsigned long i = 0; i < m->n_interfaces; i += 1)
-                varlink_array_append_string(interfaces, m->interfaces[i].name);
-        varlink_object_set_array(reply, "interfaces", interfaces);
+                r = manager_build_config(m, &m->config_cache.reply);
+                if (r >= 0)
+                        m->config_cache.generation = m->generation;
+        }
 
-        return varlink_call_reply(call, reply, 0);
+        if (r >= 0)
+                r = varlink_call_reply(call, m->config_cache.reply, 0);
+
+        pthread_mutex_unlock(&m->lock);
+
+        return r;
 }
 
-static long com_redhat_resolver_AddServices(VarlinkService *resolver_service,
-                                              VarlinkCall *call,
-                                              VarlinkObject *parameters,
-                                              uint64_t flags,
-                                              void *userdata) {
-        Manager *m = userdata;
-        long n_services;
+static long manager_build_stats(Manager *m, VarlinkObject **statsp) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *statsv = NULL;
         _cleanup_(varlink_array_unrefp) VarlinkArray *servicesv = NULL;
+        Stats stats = m->stats;
+        long r;
+
+        for (unsigned long i = 0; i < m->n_workers; i += 1)
+                stats_add_resolves(&stats, &m->workers[i].stats);
+
+        r = stats_to_object(&stats, &statsv);
+        if (r < 0)
+                return r;
+
+        varlink_array_new(&servicesv);
+        for (unsigned long s = 0; s < m->n_services; s += 1) {
+                Service *service = m->services[s];
+                _cleanup_(varlink_object_unrefp) VarlinkObject *servicev = NULL;
+
+                r = service_stats_to_object(&service->stats, &servicev);
+                if (r < 0)
+                        return r;
+
+                varlink_object_set_string(servicev, "address", service->address);
+                varlink_object_set_bool(servicev, "running", service->n_running > 0);
+                varlink_object_set_int(servicev, "instances", service->n_running);
+
+                r = varlink_array_append_object(servicesv, servicev);
+                if (r < 0)
+                        return r;
+        }
+
+        varlink_object_set_array(statsv, "services", servicesv);
+
+        *statsp = statsv;
+        statsv = NULL;
+
+        return 0;
+}
+
+static long com_redhat_resolver_GetStats(VarlinkService *resolver_service,
+                                           VarlinkCall *call,
+                                           VarlinkObject *parameters,
+                                           uint64_t flags,
+                                           void *userdata) {
+        Manager *m = userdata;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *reply = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *statsv = NULL;
+        long r;
+
+        pthread_mutex_lock(&m->lock);
+        r = manager_build_stats(m, &statsv);
+        pthread_mutex_unlock(&m->lock);
+
+        if (r < 0)
+                return r;
+
+        varlink_object_new(&reply);
+        varlink_object_set_object(reply, "stats", statsv);
+
+        return varlink_call_reply(call, reply, 0);
+}
+
+static long manager_build_info(InterfaceIndex *index, VarlinkObject **infop) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *reply = NULL;
+        _cleanup_(varlink_array_unrefp) VarlinkArray *interfaces = NULL;
+        const char **names;
+        unsigned long n_names;
+        long r;
+
+        r = interface_index_get_names(index, &names, &n_names);
+        if (r < 0)
+                return r;
+
+        varlink_object_new(&reply);
+
+        if (index->vendor)
+                varlink_object_set_string(reply, "vendor", index->vendor);
+        if (index->product)
+                varlink_object_set_string(reply, "product", index->product);
+        if (index->version)
+                varlink_object_set_string(reply, "version", index->version);
+        if (index->url)
+                varlink_object_set_string(reply, "url", index->url);
+
+        varlink_array_new(&interfaces);
+        for (unsigned long i = 0; i < n_names; i += 1)
+                varlink_array_append_string(interfaces, names[i]);
+        varlink_object_set_array(reply, "interfaces", interfaces);
+
+        *infop = reply;
+        reply = NULL;
+
+        return 0;
+}
+
+static long org_varlink_resolver_GetInfo(VarlinkService *service,
+                                         VarlinkCall *call,
+                                         VarlinkObject *parameters,
+                                         uint64_t flags,
+                                         void *userdata) {
+        Manager *m = userdata;
+        ReplyCache *cache = current_worker ? &current_worker->info_cache : &m->info_cache;
+        InterfaceIndex *index;
+        long r = 0;
+
+        if (current_worker)
+                rcu_read_lock(&current_worker->rcu);
+
+        index = manager_get_index(m);
+        if (cache->generation != index->generation) {
+                reply_cache_clear(cache);
+
+                r = manager_build_info(index, &cache->reply);
+                if (r >= 0)
+                        cache->generation = index->generation;
+        }
+
+        if (current_worker)
+                rcu_read_unlock(&current_worker->rcu);
+
+        if (r < 0)
+                return r;
+
+        return varlink_call_reply(call, cache->reply, 0);
+}
+
+/*
+ * Adds the service, or replaces the one with the same address, which may
+ * pass its interfaces on to the new one. The service is owned by the
+ * manager when *servicep is reset. On failure, the old service stays.
+ */
+static long manager_replace_service(Manager *m, Service **servicep) {
+        Service *service = *servicep;
+        Service *service_old;
+        bool same_path;
+        long r;
+
+        if (manager_find_service_by_address(m, &service_old, service->address) < 0)
+                service_old = NULL;
+
+        same_path = service_old && service_old->path_to_unlink && service->path_to_unlink &&
+                    strcmp(service_old->path_to_unlink, service->path_to_unlink) == 0;
+
+        if (service_old)
+                manager_unindex_service(m, service_old);
+
+        r = manager_add_service(m, service);
+        if (r < 0) {
+                if (service_old)
+                        manager_index_service(m, service_old);
+
+                /* The old service still listens at the path. */
+                if (same_path) {
+                        free(service->path_to_unlink);
+                        service->path_to_unlink = NULL;
+                }
+
+                return r;
+        }
+
+        *servicep = NULL;
+
+        if (service_old) {
+                /* The new socket took over the path, do not unlink it. */
+                if (same_path) {
+                        free(service_old->path_to_unlink);
+                        service_old->path_to_unlink = NULL;
+                }
+
+                r = manager_remove_service(m, service_old);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static long manager_add_services(Manager *m, VarlinkCall *call, VarlinkObject *parameters) {
+        VarlinkArray *servicesv;
+        _cleanup_(service_array_clear) ServiceArray array = {};
+        long r;
+
+        r = varlink_object_get_array(parameters, "services", &servicesv);
+        if (r < 0)
+                return varlink_call_reply_invalid_parameter(call, "services");
+
+        r = service_array_parse(&array, servicesv);
+        if (r < 0)
+                return r;
+
+        r = service_listen_many(array.services, array.n_services);
+        if (r < 0)
+                return r;
+
+        for (unsigned long s = 0; s < array.n_services; s += 1) {
+                r = manager_replace_service(m, &array.services[s]);
+                if (r < 0)
+                        return r;
+        }
+
+        return varlink_call_reply(call, NULL, 0);
+}
+
+static long com_redhat_resolver_AddServices(VarlinkService *resolver_service,
+                                              VarlinkCall *call,
+                                              VarlinkObject *parameters,
+                                              uint64_t flags,
+                                              void *userdata) {
+        Manager *m = userdata;
+        long r;
+
+        pthread_mutex_lock(&m->lock);
+
+        r = manager_add_services(m, call, parameters);
+        if (manager_index_changed(m) < 0)
+                r = -ENOMEM;
+
+        pthread_mutex_unlock(&m->lock);
+
+        return r;
+}
+
+static long manager_remove_services(Manager *m, VarlinkCall *call, VarlinkObject *parameters) {
+        VarlinkArray *servicesv;
+        long n_services;
+        long r;
+
+        r = varlink_object_get_array(parameters, "services", &servicesv);
+        if (r < 0)
+                return varlink_call_reply_invalid_parameter(call, "services");
+
+        n_services = varlink_array_get_n_elements(servicesv);
+        if (n_services < 0)
+                return n_services;
+
+        /* Check all addresses first, the call either removes all services or none. */
+        for (long s = 0; s < n_services; s += 1) {
+                VarlinkObject *servicev;
+                const char *address;
+                Service *service;
+
+                r = varlink_array_get_object(servicesv, s, &servicev);
+                if (r < 0)
+                        return varlink_call_reply_invalid_parameter(call, "services");
+
+                if (varlink_object_get_string(servicev, "address", &address) < 0)
+                        return varlink_call_reply_invalid_parameter(call, "address");
+
+                if (manager_find_service_by_address(m, &service, address) < 0) {
+                        _cleanup_(varlink_object_unrefp) VarlinkObject *error = NULL;
+
+                        varlink_object_new(&error);
+                        varlink_object_set_string(error, "address", address);
+
+                        return varlink_call_reply_error(call, "com.redhat.resolver.ServiceNotFound", error);
+                }
+        }
+
+        for (long s = 0; s < n_services; s += 1) {
+                VarlinkObject *servicev;
+                const char *address;
+                Service *service;
+
+                varlink_array_get_object(servicesv, s, &servicev);
+                varlink_object_get_string(servicev, "address", &address);
+
+                /* The same address might be listed twice. */
+                if (manager_find_service_by_address(m, &service, address) < 0)
+                        continue;
+
+                /* Closes and unlinks the listen socket, and terminates the running child. */
+                r = manager_remove_service(m, service);
+                if (r < 0)
+                        return r;
+        }
+
+        return varlink_call_reply(call, NULL, 0);
+}
+
+static long com_redhat_resolver_RemoveService(VarlinkService *resolver_service,
+                                               VarlinkCall *call,
+                                               VarlinkObject *parameters,
+                                               uint64_t flags,
+                                               void *userdata) {
+        Manager *m = userdata;
+        long r;
+
+        pthread_mutex_lock(&m->lock);
+
+        r = manager_remove_services(m, call, parameters);
+        if (manager_index_changed(m) < 0)
+                r = -ENOMEM;
+
+        pthread_mutex_unlock(&m->lock);
+
+        return r;
+}
+
+static long manager_add_interfaces(Manager *m, VarlinkService *service) {
+        long r;
+
+        r = varlink_service_add_interface(service, org_varlink_resolver_varlink,
+                                          "Resolve", org_varlink_resolver_Resolve, m,
+                                          "GetInfo", org_varlink_resolver_GetInfo, m,
+                                          NULL);
+        if (r < 0)
+                return r;
+
+        return varlink_service_add_interface(service, com_redhat_resolver_varlink,
+                                             "GetConfig", com_redhat_resolver_GetConfig, m,
+                                             "AddServices", com_redhat_resolver_AddServices, m,
+                                             "RemoveService", com_redhat_resolver_RemoveService, m,
+                                             "GetStats", com_redhat_resolver_GetStats, m,
+                                             "ResolveMany", com_redhat_resolver_ResolveMany, m,
+                                             "Subscribe", com_redhat_resolver_Subscribe, m,
+                                             NULL);
+}
+
+static void *worker_run(void *userdata) {
+        Worker *w = userdata;
+
+        current_worker = w;
+
+        for (;;) {
+                struct epoll_event ev;
+                long r;
+
+                if (epoll_wait(w->epoll_fd, &ev, 1, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        fprintf(stderr, "Error waiting for events: %s\n", strerror(errno));
+                        eventfd_write(w->failed_fd, 1);
+                        return NULL;
+                }
+
+                if (ev.data.fd == w->exit_fd)
+                        break;
+
+                if (ev.data.fd == w->notify_fd) {
+                        eventfd_t value;
+
+                        eventfd_read(w->notify_fd, &value);
+
+                        rcu_read_lock(&w->rcu);
+                        subscription_list_notify(&w->subscriptions, __atomic_load_n(w->published, __ATOMIC_SEQ_CST));
+                        rcu_read_unlock(&w->rcu);
+                        continue;
+                }
+
+                r = varlink_service_process_events(w->service);
+                switch (r) {
+                        case 0:
+                        case -VARLINK_ERROR_CANNOT_ACCEPT:
+                        case -VARLINK_ERROR_CONNECTION_CLOSED:
+                                break;
+
+                        default:
+                                fprintf(stderr, "Error processing events: %s\n", varlink_error_string(-r));
+                                eventfd_write(w->failed_fd, 1);
+                                return NULL;
+                }
+        }
+
+        return NULL;
+}
+
+/* Sets up the worker's own VarlinkService on a duplicate of the listen fd, and its epoll set. */
+static long worker_init(Worker *w, Manager *m, const char *address, int listen_fd) {
+        struct epoll_event ev = {};
+        int fd;
+        long r;
+
+        w->exit_fd = m->exit_fd;
+        w->failed_fd = m->failed_fd;
+        w->published = &m->published;
+        w->stats.start_usec = m->stats.start_usec;
+
+        w->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->notify_fd < 0)
+                return -errno;
+
+        fd = fcntl(listen_fd, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+                return -errno;
+
+        r = varlink_service_new(&w->service,
+                                "Varlink",
+                                "Resolver",
+                                VERSION,
+                                "https://github.com/varlink/org.varlink.resolver",
+                                address,
+                                fd);
+        if (r < 0) {
+                close(fd);
+                return r;
+        }
+
+        r = manager_add_interfaces(m, w->service);
+        if (r < 0)
+                return r;
+
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epoll_fd < 0)
+                return -errno;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = varlink_service_get_fd(w->service);
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, varlink_service_get_fd(w->service), &ev) < 0)
+                return -errno;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = m->exit_fd;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, m->exit_fd, &ev) < 0)
+                return -errno;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = w->notify_fd;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->notify_fd, &ev) < 0)
+                return -errno;
+
+        return 0;
+}
+
+/*
+ * Starts threads serving the resolver interface on the same listen
+ * socket as the main thread. The kernel hands every new connection to
+ * one of them.
+ */
+static long manager_start_workers(Manager *m, unsigned long n_workers, const char *address, int listen_fd) {
+        struct epoll_event ev = {};
+        long r;
+
+        m->exit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m->exit_fd < 0)
+                return -errno;
+
+        m->failed_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m->failed_fd < 0)
+                return -errno;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = m->failed_fd;
+        if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, m->failed_fd, &ev) < 0)
+                return -errno;
+
+        m->workers = calloc(n_workers, sizeof(Worker));
+        if (!m->workers)
+                return -ENOMEM;
+
+        /* Workers only read the published copy, it must exist before they start. */
+        r = manager_publish_index(m);
+        if (r < 0)
+                return r;
+
+        for (unsigned long i = 0; i < n_workers; i += 1) {
+                Worker *w = &m->workers[i];
+
+                w->epoll_fd = -1;
+                w->notify_fd = -1;
+
+                r = worker_init(w, m, address, listen_fd);
+                if (r < 0) {
+                        worker_clear(w);
+                        return r;
+                }
+
+                if (pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+                        worker_clear(w);
+                        return -EAGAIN;
+                }
+
+                m->n_workers += 1;
+        }
+
+        return 0;
+}
+
+/* The timer fires at the earliest restart, idle or pressure deadline. */
+static long manager_arm_timer(Manager *m) {
+        struct itimerspec its = {};
+        uint64_t usec = UINT64_MAX;
+        uint64_t next_usec;
+
+        prioq_peek(m->restarts, &usec);
+        if (prioq_peek(m->idle, &next_usec))
+                usec = MIN(usec, next_usec);
+        if (prioq_peek(m->pressure, &next_usec))
+                usec = MIN(usec, next_usec);
+
+        /* An all-zero value disarms the timer, fire expired deadlines right away. */
+        if (usec != UINT64_MAX) {
+                its.it_value.tv_sec = usec / USEC_PER_SEC;
+                its.it_value.tv_nsec = (usec % USEC_PER_SEC) * 1000;
+                if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+                        its.it_value.tv_nsec = 1;
+        }
+
+        if (timerfd_settime(m->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+                return -errno;
+
+        return 0;
+}
+
+/* The earliest time the service may be stopped, moved by every resolve. */
+static uint64_t service_idle_deadline(Service *service) {
+        uint64_t used = __atomic_load_n(&service->used_usec, __ATOMIC_RELAXED);
+
+        return MAX(service->started_usec + service->min_lifetime_usec, used + service->max_idle_usec);
+}
+
+static long manager_schedule_idle(Manager *m, Service *service) {
+        long r;
+
+        if (service->max_idle_usec == 0)
+                return 0;
+
+        r = prioq_put(m->idle, service, service_idle_deadline(service), &service->idle_index);
+        if (r < 0)
+                return r;
+
+        return manager_arm_timer(m);
+}
+
+/* Terminates the running instances, the last exit re-arms the listen socket like a clean exit. */
+static void manager_stop_idle_service(Manager *m, Service *service) {
+        prioq_remove(m->idle, &service->idle_index);
+        prioq_remove(m->pressure, &service->pressure_index);
+        service->stopping = true;
+        service->stopped_usec = now_usec();
+
+        for (unsigned long i = 0; i < service->n_instances_max; i += 1)
+                if (service->instances[i].pid > 0)
+                        kill(service->instances[i].pid, SIGTERM);
+}
+
+/*
+ * Stops the least recently used service which ran for its minimum
+ * lifetime. The limit is not enforced beyond that; if all running
+ * services are younger, the new one runs in addition.
+ */
+static void manager_evict_service(Manager *m) {
+        uint64_t now = now_usec();
+        unsigned long n_running = 0;
+        Service *lru = NULL;
+        uint64_t lru_used = 0;
+
+        for (unsigned long s = 0; s < m->n_services; s += 1) {
+                Service *service = m->services[s];
+                uint64_t used;
+
+                if (service->n_running == 0 || service->stopping)
+                        continue;
+
+                n_running += 1;
+
+                if (now < service->started_usec + service->min_lifetime_usec)
+                        continue;
+
+                used = __atomic_load_n(&service->used_usec, __ATOMIC_RELAXED);
+                if (!lru || used < lru_used) {
+                        lru = service;
+                        lru_used = used;
+                }
+        }
+
+        if (n_running < m->n_running_max || !lru)
+                return;
+
+        counter_inc(&m->stats.n_evictions);
+        counter_inc(&lru->stats.n_evictions);
+        manager_stop_idle_service(m, lru);
+}
+
+/*
+ * Prepares the pool of spawners, if enabled. The zygote is forked before
+ * the services are read and the workers are started; forking the spawners
+ * from it does not copy the page tables of the grown manager.
+ */
+static long manager_start_spawners(Manager *m) {
+        long r;
+
+        if (m->n_spawners_max == 0)
+                return 0;
+
+        m->spawners = calloc(m->n_spawners_max, sizeof(Spawner *));
+        if (!m->spawners)
+                return -ENOMEM;
+
+        r = spawn_environment_new(&m->spawn_envp, &m->n_spawn_envp, m->ready_socket);
+        if (r < 0)
+                return r;
+
+        /* Not fatal, we fork the spawners ourselves. */
+        r = spawn_zygote_new(&m->zygote_fd, m->spawn_envp, m->n_spawn_envp, &m->oldmask);
+        if (r < 0)
+                fprintf(stderr, "Warning: starting zygote: %s.\n", strerror(-r));
+
+        return 0;
+}
+
+/* Tops up the pool of spawners, if enabled. */
+static long manager_refill_spawners(Manager *m) {
+        long r;
+
+        while (m->n_spawners < m->n_spawners_max) {
+                Spawner **spawnerp = &m->spawners[m->n_spawners];
+
+                if (m->zygote_fd >= 0) {
+                        r = spawner_new_from_zygote(spawnerp, m->zygote_fd);
+
+                        /* The zygote died, we fork the spawners ourselves from now on. */
+                        if (r == -EPIPE || r == -ECONNRESET) {
+                                fprintf(stderr, "Warning: zygote exited.\n");
+                                close(m->zygote_fd);
+                                m->zygote_fd = -1;
+                        }
+                }
+
+                if (m->zygote_fd < 0)
+                        r = spawner_new(spawnerp, m->spawn_envp, m->n_spawn_envp, &m->oldmask);
+
+                if (r < 0)
+                        return r;
+
+                m->n_spawners += 1;
+        }
+
+        return 0;
+}
+
+/* A reaped pid may be reused, the spawner must not signal it anymore. */
+static void manager_forget_spawner(Manager *m, pid_t pid) {
+        for (unsigned long i = 0; i < m->n_spawners; i += 1)
+                if (m->spawners[i]->pid == pid) {
+                        m->spawners[i]->pid = -1;
+                        break;
+                }
+}
+
+/*
+ * Hands the instance to a spawner from the pool, a dead one is skipped.
+ * A request the spawner cannot take, like a too long command line, is
+ * not the spawner's fault; it goes back to the pool.
+ */
+static long manager_activate_with_spawner(Manager *m, ServiceInstance *instance) {
+        while (m->n_spawners > 0) {
+                _cleanup_(spawner_freep) Spawner *spawner = NULL;
+                long r;
+
+                m->n_spawners -= 1;
+                spawner = m->spawners[m->n_spawners];
+
+                r = spawner_activate(spawner, instance);
+                if (r >= 0)
+                        return 0;
+
+                if (r != -EPIPE && r != -ECONNREFUSED && r != -ECONNRESET) {
+                        m->spawners[m->n_spawners] = spawner;
+                        m->n_spawners += 1;
+                        spawner = NULL;
+
+                        return r;
+                }
+        }
+
+        return -ENOENT;
+}
+
+/* Without a pidfd, the exit is only noticed by SIGCHLD. */
+static long manager_watch_process(Manager *m, ServiceInstance *instance) {
+        struct epoll_event ev = {};
+        long r;
+
+        r = hashmap_put(m->pids, INT_TO_PTR(instance->pid), instance);
+        if (r < 0)
+                return r;
+
+        instance->service->n_running += 1;
+
+        if (instance->pid_fd < 0)
+                return 0;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &instance->process_watch;
+        if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, instance->pid_fd, &ev) < 0)
+                return -errno;
+
+        return 0;
+}
+
+/* The instance called exec(), or exited trying. */
+static void manager_instance_executed(Manager *m, ServiceInstance *instance) {
+        uint64_t usec = now_usec() - instance->started_usec;
+
+        if (instance->exec_fd >= 0) {
+                close(instance->exec_fd);
+                instance->exec_fd = -1;
+        }
+
+        instance->exec_usec = instance->started_usec + usec;
+        histogram_add(&m->stats.exec, usec);
+        instance->service->stats.exec_usec = usec;
+}
+
+static void manager_instance_ready(Manager *m, ServiceInstance *instance) {
+        uint64_t usec = now_usec() - instance->started_usec;
+
+        /* Services send it again after they reloaded. */
+        if (instance->ready_usec > 0)
+                return;
+
+        instance->ready_usec = instance->started_usec + usec;
+        histogram_add(&m->stats.ready, usec);
+        instance->service->stats.ready_usec = usec;
+}
+
+static long manager_start_instance(Manager *m, ServiceInstance *instance) {
+        Service *service = instance->service;
+        struct epoll_event ev = {};
+        uint64_t start;
+        long r;
+
+        /*
+         * A spawner execs the instance without us waiting for it. Otherwise
+         * the child shares our memory until it called exec(), we continue
+         * after that.
+         */
+        start = now_usec();
+        r = manager_activate_with_spawner(m, instance);
+        if (r < 0)
+                r = service_activate(instance, m->ready_socket, &m->oldmask);
+        if (r < 0) {
+                counter_inc(&m->stats.n_activation_failures);
+                return r;
+        }
+
+        histogram_add(&m->stats.activation, now_usec() - start);
+        counter_inc(&m->stats.n_activations);
+        counter_inc(&service->stats.n_activations);
+
+        instance->started_usec = start;
+        instance->exec_usec = 0;
+        instance->ready_usec = 0;
+
+        r = manager_watch_process(m, instance);
+        if (r < 0)
+                return r;
+
+        /* Without a spawner, we continued after the exec. */
+        if (instance->exec_fd < 0) {
+                manager_instance_executed(m, instance);
+                return 0;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &instance->exec_watch;
+        if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, instance->exec_fd, &ev) < 0)
+                return -errno;
+
+        return 0;
+}
+
+static long manager_schedule_pressure(Manager *m, Service *service) {
+        long r;
+
+        if (service->n_instances_max == service->n_instances)
+                return 0;
+
+        r = prioq_put(m->pressure, service, now_usec() + PRESSURE_INTERVAL_USEC, &service->pressure_index);
+        if (r < 0)
+                return r;
+
+        return manager_arm_timer(m);
+}
+
+/*
+ * Starts the instances of the service, except the ones waiting for
+ * their restart. Connections piling up on the socket start more.
+ */
+static long manager_activate_service(Manager *m, Service *service) {
+        long r;
+
+        assert(service->n_running == 0);
+
+        manager_unwatch_service(m, service);
+
+        if (m->n_running_max > 0)
+                manager_evict_service(m);
+
+        service->started_usec = now_usec();
+        service->used_usec = service->started_usec;
+
+        for (unsigned long i = 0; i < service->n_instances; i += 1) {
+                if (service->instances[i].failed)
+                        continue;
+
+                r = manager_start_instance(m, &service->instances[i]);
+                if (r < 0)
+                        return r;
+        }
+
+        r = manager_schedule_idle(m, service);
+        if (r < 0)
+                return r;
+
+        return manager_schedule_pressure(m, service);
+}
+
+/*
+ * A connection which is still waiting in the listen queue at
+ * consecutive samples is not accepted fast enough by the running
+ * instances, start one more. The instances added this way run until
+ * they exit, or the service is stopped.
+ */
+static long manager_sample_pressure(Manager *m, Service *service) {
+        struct pollfd pfd = {
+                .fd = service->listen_fd,
+                .events = POLLIN,
+        };
+        long r;
+
+        if (poll(&pfd, 1, 0) < 0)
+                return -errno;
+
+        if (pfd.revents & POLLIN)
+                service->n_pressure += 1;
+        else
+                service->n_pressure = 0;
+
+        if (service->n_pressure >= PRESSURE_SAMPLES) {
+                ServiceInstance *instance = NULL;
+
+                for (unsigned long i = 0; i < service->n_instances_max; i += 1) {
+                        if (service->instances[i].pid < 0 && !service->instances[i].failed) {
+                                instance = &service->instances[i];
+                                break;
+                        }
+                }
+
+                if (instance) {
+                        service->n_pressure = 0;
+                        counter_inc(&m->stats.n_scale_ups);
+                        counter_inc(&service->stats.n_scale_ups);
+
+                        r = manager_start_instance(m, instance);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        return prioq_put(m->pressure, service, now_usec() + PRESSURE_INTERVAL_USEC, &service->pressure_index);
+}
+
+static long manager_activate_configured_services(Manager *m) {
+        long r;
+
+        for (unsigned long i = 0; i < m->n_services; i += 1) {
+                Service *service = m->services[i];
+
+                if (!service->activate_at_startup)
+                        continue;
+
+                r = manager_activate_service(m, service);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+/*
+ * Every consecutive failure doubles the delay until the service is
+ * activated again, up to a maximum. Half of the delay is randomized,
+ * services which failed together do not come back together.
+ */
+static long manager_schedule_restart(Manager *m, ServiceInstance *instance) {
+        Service *service = instance->service;
+        uint64_t backoff;
+        uint64_t delay;
+        long r;
+
+        instance->n_failures += 1;
+        backoff = RESTART_BACKOFF_MIN_USEC << MIN(instance->n_failures - 1, 16UL);
+        backoff = MIN(backoff, RESTART_BACKOFF_MAX_USEC);
+        delay = backoff / 2 + (uint64_t)random() % (backoff / 2 + 1);
+
+        counter_add(&service->stats.backoff_usec, delay);
+
+        instance->failed = true;
+        r = prioq_put(m->restarts, instance, now_usec() + delay, &instance->restart_index);
+        if (r < 0)
+                return r;
+
+        fprintf(stderr, "%s: disable re-execution for %llu msec\n",
+                service->executable, (unsigned long long)(delay / 1000));
+
+        return manager_arm_timer(m);
+}
+
+static long manager_process_timer(Manager *m) {
+        uint64_t expirations;
+        uint64_t now = now_usec();
+        uint64_t usec;
+        long r;
+
+        if (read(m->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                return -errno;
+
+        while (prioq_peek(m->restarts, &usec) && usec <= now) {
+                ServiceInstance *instance = prioq_pop(m->restarts);
+                Service *service = instance->service;
+
+                instance->failed = false;
+                counter_inc(&m->stats.n_restarts);
+                counter_inc(&service->stats.n_restarts);
+
+                /* The other instances are running, join them. */
+                if (service->n_running > 0 && !service->stopping)
+                        r = manager_start_instance(m, instance);
+                else
+                        r = manager_update_watch(m, service);
+                if (r < 0)
+                        return r;
+        }
+
+        while (prioq_peek(m->idle, &usec) && usec <= now) {
+                Service *service = prioq_pop(m->idle);
+                uint64_t deadline = service_idle_deadline(service);
+
+                /* Resolved since it was queued, wait for the new deadline. */
+                if (deadline > now) {
+                        r = prioq_put(m->idle, service, deadline, &service->idle_index);
+                        if (r < 0)
+                                return r;
+
+                        continue;
+                }
+
+                counter_inc(&m->stats.n_idle_stops);
+                counter_inc(&service->stats.n_idle_stops);
+                manager_stop_idle_service(m, service);
+        }
+
+        while (prioq_peek(m->pressure, &usec) && usec <= now) {
+                Service *service = prioq_pop(m->pressure);
+
+                r = manager_sample_pressure(m, service);
+                if (r < 0)
+                        return r;
+        }
+
+        return manager_arm_timer(m);
+}
+
+/*
+ * A crashed instance is restarted after its own backoff, while the
+ * other instances keep running. When the last instance is gone, the
+ * next connection activates the service again.
+ */
+static long manager_instance_exited(Manager *m, ServiceInstance *instance, siginfo_t *si) {
+        Service *service = instance->service;
+        long r;
+
+        /* Closing the pidfd removes it from the epoll set. */
+        hashmap_remove(m->pids, INT_TO_PTR(instance->pid));
+        service_reaped(instance);
+        service->n_running -= 1;
+
+        counter_add(&service->stats.running_usec, now_usec() - instance->started_usec);
+
+        if (service->n_running == 0) {
+                prioq_remove(m->idle, &service->idle_index);
+                prioq_remove(m->pressure, &service->pressure_index);
+                service->n_pressure = 0;
+        }
+
+        /* We stopped it, whatever the exit status. */
+        if (service->stopping) {
+                instance->n_failures = 0;
+                if (service->n_running > 0)
+                        return 0;
+
+                service->stopping = false;
+                histogram_add(&m->stats.teardown, now_usec() - service->stopped_usec);
+
+                return manager_update_watch(m, service);
+        }
+
+        if (si->si_code == CLD_EXITED && si->si_status == 0) {
+                instance->n_failures = 0;
+
+                return manager_update_watch(m, service);
+        }
+
+        counter_inc(&m->stats.n_crashes);
+        counter_inc(&service->stats.n_crashes);
+
+        if (si->si_code == CLD_EXITED)
+                fprintf(stderr, "%s: exit code: %s\n", service->executable, strerror(si->si_status));
+        else if (si->si_code == CLD_KILLED || si->si_code == CLD_DUMPED)
+                fprintf(stderr, "%s: killed by signal: %s\n", service->executable, strsignal(si->si_status));
+        else
+                fprintf(stderr, "%s: status %i:%i\n", service->executable, si->si_code, si->si_status);
+
+        /* The socket is shared, it is only replaced when no instance uses it. */
+        if (service->n_running == 0) {
+                r = service_reset(service);
+                if (r < 0)
+                        return r;
+        }
+
+        r = manager_schedule_restart(m, instance);
+        if (r < 0)
+                return r;
+
+        return manager_update_watch(m, service);
+}
+
+/* The pidfd of a running instance became readable, reap just this child. */
+static long manager_process_instance_exit(Manager *m, ServiceInstance *instance) {
+        siginfo_t si = {};
+
+        /* Already reaped by the SIGCHLD handler in this batch. */
+        if (instance->pid < 0)
+                return 0;
+
+        if (waitid(P_PID, instance->pid, &si, WEXITED|WNOHANG) < 0)
+                return errno == ECHILD ? 0 : -errno;
+
+        if (si.si_pid == 0)
+                return 0;
+
+        return manager_instance_exited(m, instance, &si);
+}
+
+/* Reads the whole file into a NUL-terminated buffer, sized by fstat(). */
+static long read_file(int fd, char **contentsp, unsigned long *sizep) {
+        _cleanup_(freep) char *contents = NULL;
+        unsigned long n_allocated;
+        unsigned long size = 0;
+        struct stat st;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        /* One more byte than the file size, to see EOF without another resize. */
+        n_allocated = S_ISREG(st.st_mode) ? (unsigned long)st.st_size + 2 : 4096;
+
+        contents = malloc(n_allocated);
+        if (!contents)
+                return -ENOMEM;
+
+        for (;;) {
+                long n;
+
+                if (size + 1 == n_allocated) {
+                        char *p;
+
+                        p = realloc(contents, n_allocated * 2);
+                        if (!p)
+                                return -ENOMEM;
+
+                        contents = p;
+                        n_allocated *= 2;
+                }
+
+                n = read(fd, contents + size, n_allocated - size - 1);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                }
+
+                if (n == 0)
+                        break;
+
+                size += n;
+        }
+
+        contents[size] = '\0';
+
+        *contentsp = contents;
+        contents = NULL;
+        *sizep = size;
+
+        return 0;
+}
+
+static long manager_set_idle_policy(Manager *m, Service *service, Service *policy) {
+        if (service->min_lifetime_usec == policy->min_lifetime_usec &&
+            service->max_idle_usec == policy->max_idle_usec)
+                return 0;
+
+        service->min_lifetime_usec = policy->min_lifetime_usec;
+        service->max_idle_usec = policy->max_idle_usec;
+        m->generation += 1;
+
+        if (service->n_running == 0 || service->stopping)
+                return 0;
+
+        prioq_remove(m->idle, &service->idle_index);
+
+        return manager_schedule_idle(m, service);
+}
+
+/*
+ * A new service which failed to get its own socket must not unlink the
+ * path of the old service it borrowed the socket from.
+ */
+static void manager_drop_shared_paths(Manager *m, ServiceArray *array) {
+        for (unsigned long s = 0; s < array->n_services; s += 1) {
+                Service *service = array->services[s];
+                Service *service_old;
+
+                if (!service->path_to_unlink ||
+                    manager_find_service_by_address(m, &service_old, service->address) < 0 ||
+                    !service_old->path_to_unlink ||
+                    strcmp(service_old->path_to_unlink, service->path_to_unlink) != 0)
+                        continue;
+
+                free(service->path_to_unlink);
+                service->path_to_unlink = NULL;
+        }
+}
+
+/*
+ * Brings the services in line with the configuration. Services are
+ * matched by address: unchanged ones are kept with their socket and
+ * child, changed ones are replaced by a new service sharing the old
+ * socket, and services no longer in the configuration are removed.
+ * Services added with AddServices at other addresses are not touched.
+ *
+ * Nothing is changed before the configuration is valid and all new
+ * sockets exist. After that, a service which fails to be added is
+ * skipped, the first error is returned after the remaining ones were
+ * applied.
+ */
+static long manager_apply_config(Manager *m,
+                                 ServiceArray *config,
+                                 const char *vendor,
+                                 const char *product,
+                                 const char *version,
+                                 const char *url,
+                                 bool activate) {
+        _cleanup_(service_array_clear) ServiceArray array = *config;
+        _cleanup_(service_array_clear) ServiceArray unchanged = {};
+        _cleanup_(hashmap_freep) Hashmap *addresses = NULL;
+        unsigned long n_services = 0;
+        long error = 0;
+        long r;
+
+        *config = (ServiceArray){};
+
+        r = hashmap_new(&addresses, &string_hash_ops);
+        if (r < 0)
+                return r;
+
+        for (unsigned long s = 0; s < array.n_services; s += 1) {
+                array.services[s]->configured = true;
+
+                r = hashmap_put(addresses, array.services[s]->address, array.services[s]);
+                if (r < 0)
+                        return r == -EEXIST ? -ENOTUNIQ : r;
+        }
+
+        unchanged.services = calloc(MAX(array.n_services, 1UL), sizeof(Service *));
+        if (!unchanged.services)
+                return -ENOMEM;
+
+        /* Set the unchanged services aside, only the new and changed ones remain in the array. */
+        for (unsigned long s = 0; s < array.n_services; s += 1) {
+                Service *service = array.services[s];
+                Service *service_old;
+
+                if (manager_find_service_by_address(m, &service_old, service->address) >= 0) {
+                        if (service_equal(service_old, service)) {
+                                unchanged.services[unchanged.n_services] = service;
+                                unchanged.n_services += 1;
+                                continue;
+                        }
+
+                        r = service_share_listen(service, service_old);
+                        if (r < 0) {
+                                if (error == 0)
+                                        error = r;
+
+                                service_free(service);
+                                continue;
+                        }
+                }
+
+                array.services[n_services] = service;
+                n_services += 1;
+        }
+
+        array.n_services = n_services;
+
+        /* Prepare all new listen sockets first, then register them in one pass. */
+        r = service_listen_many(array.services, array.n_services);
+        if (r < 0) {
+                manager_drop_shared_paths(m, &array);
+                return r;
+        }
+
+        /* The replies of GetInfo are cached per version of the index. */
+        if (interface_index_set_info(m->index, vendor, product, version, url))
+                m->generation += 1;
+
+        /* Backwards, a removed service is replaced by the last one. */
+        for (unsigned long i = m->n_services; i > 0; i -= 1) {
+                Service *service = m->services[i - 1];
+
+                if (!service->configured || hashmap_get(addresses, service->address))
+                        continue;
+
+                r = manager_remove_service(m, service);
+                if (r < 0)
+                        return r;
+        }
+
+        for (unsigned long s = 0; s < unchanged.n_services; s += 1) {
+                Service *service_old;
+
+                r = manager_find_service_by_address(m, &service_old, unchanged.services[s]->address);
+                if (r < 0)
+                        return r;
+
+                service_old->configured = true;
+
+                r = manager_set_idle_policy(m, service_old, unchanged.services[s]);
+                if (r < 0 && error == 0)
+                        error = r;
+        }
+
+        for (unsigned long s = 0; s < array.n_services; s += 1) {
+                Service *service = array.services[s];
+
+                r = manager_replace_service(m, &array.services[s]);
+                if (r < 0) {
+                        fprintf(stderr, "Error: adding service %s: %s.\n", service->address, strerror(-r));
+                        if (error == 0)
+                                error = r;
+
+                        continue;
+                }
+
+                if (activate && service->activate_at_startup) {
+                        r = manager_activate_service(m, service);
+                        if (r < 0 && error == 0)
+                                error = r;
+                }
+        }
+
+        return error;
+}
+
+/* Returns the identity of the file in *stp, all zero if there is no file. */
+static long manager_read_config(Manager *m, const char *config, bool activate, struct stat *stp) {
+        _cleanup_(closep) int fd = -1;
+        _cleanup_(freep) char *json = NULL;
+        unsigned long size = 0;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *configv = NULL;
+        VarlinkArray *servicesv;
+        _cleanup_(service_array_clear) ServiceArray array = {};
+        const char *info[4] = {};
+        long r;
+
+        *stp = (struct stat){};
+
+        fd = open(config, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                /* treat no file the same as '{}' */
+                if (errno != ENOENT)
+                        return -errno;
+        } else {
+                if (fstat(fd, stp) < 0)
+                        return -errno;
+
+                r = read_file(fd, &json, &size);
+                if (r < 0)
+                        return r;
+        }
+
+        if (size > 0) {
+                r = varlink_object_new_from_json(&configv, json);
+                if (r < 0)
+                        return r;
+
+                varlink_object_get_string(configv, "vendor", &info[0]);
+                varlink_object_get_string(configv, "product", &info[1]);
+                varlink_object_get_string(configv, "version", &info[2]);
+                varlink_object_get_string(configv, "url", &info[3]);
+
+                r = varlink_object_get_array(configv, "services", &servicesv);
+                if (r < 0)
+                        return r;
+
+                r = service_array_parse(&array, servicesv);
+                if (r < 0)
+                        return r;
+        }
+
+        return manager_apply_config(m, &array, info[0], info[1], info[2], info[3], activate);
+}
+
+/* Uses the snapshot only if it was compiled from the current configuration file. */
+static long manager_read_snapshot(Manager *m) {
+        _cleanup_(snapshot_freep) Snapshot *snapshot = NULL;
+        _cleanup_(service_array_clear) ServiceArray array = {};
+        struct stat st;
+        long r;
+
+        if (stat(m->config, &st) < 0)
+                return -errno;
+
+        r = snapshot_open(&snapshot, m->snapshot, &st);
+        if (r < 0)
+                return r;
+
+        r = snapshot_get_services(snapshot, &array);
+        if (r < 0)
+                return r;
+
+        return manager_apply_config(m,
+                                    &array,
+                                    snapshot->vendor,
+                                    snapshot->product,
+                                    snapshot->version,
+                                    snapshot->url,
+                                    false);
+}
+
+static void manager_write_snapshot(Manager *m, const struct stat *config_st) {
+        long r;
+
+        /* No file, nothing to compile. */
+        if (!m->snapshot || config_st->st_ino == 0)
+                return;
+
+        r = snapshot_write(m->snapshot,
+                           config_st,
+                           m->index->vendor,
+                           m->index->product,
+                           m->index->version,
+                           m->index->url,
+                           m->services, m->n_services);
+        if (r < 0)
+                fprintf(stderr, "Warning: writing snapshot: %s.\n", strerror(-r));
+}
+
+/* The changes become visible to the workers and subscribers at once. */
+static void manager_reload_config(Manager *m) {
+        struct stat st;
+        long r;
+
+        r = manager_read_config(m, m->config, true, &st);
+        if (r < 0)
+                fprintf(stderr, "Error: reloading configuration: %s.\n", strerror(-r));
+        else
+                manager_write_snapshot(m, &st);
+
+        r = manager_index_changed(m);
+        if (r < 0)
+                fprintf(stderr, "Error: publishing configuration: %s.\n", strerror(-r));
+}
+
+/* Watches the directory, editors replace the file instead of writing to it. */
+static long manager_watch_config(Manager *m) {
+        _cleanup_(freep) char *directory = NULL;
+        struct epoll_event ev = {};
+        const char *slash;
+
+        slash = strrchr(m->config, '/');
+        if (slash) {
+                directory = strndup(m->config, MAX(slash - m->config, 1L));
+                m->config_name = slash + 1;
+        } else {
+                directory = strdup(".");
+                m->config_name = m->config;
+        }
+
+        if (!directory)
+                return -ENOMEM;
+
+        m->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m->inotify_fd < 0)
+                return -errno;
+
+        if (inotify_add_watch(m->inotify_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+                return -errno;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = m->inotify_fd;
+        if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, m->inotify_fd, &ev) < 0)
+                return -errno;
+
+        return 0;
+}
+
+static long manager_process_inotify(Manager *m) {
+        char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        bool changed = false;
+
+        for (;;) {
+                long n;
+
+                n = read(m->inotify_fd, buffer, sizeof(buffer));
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        if (errno == EAGAIN)
+                                break;
+
+                        return -errno;
+                }
+
+                for (char *p = buffer; p < buffer + n;) {
+                        struct inotify_event *event = (struct inotify_event *)p;
+
+                        if (event->mask & IN_Q_OVERFLOW)
+                                changed = true;
+                        else if (event->len > 0 && strcmp(event->name, m->config_name) == 0)
+                                changed = true;
+
+                        p += sizeof(struct inotify_event) + event->len;
+                }
+        }
+
+        if (changed)
+                manager_reload_config(m);
+
+        return 0;
+}
+
+/*
+ * The socket for the sd_notify() protocol lives in the abstract namespace
+ * and is named after our pid, which a re-execution keeps. A socket handed
+ * over by the previous binary keeps the messages which were not read yet.
+ * The credentials of the sender are attached to every message.
+ */
+static long manager_open_ready_socket(Manager *m, VarlinkObject *state) {
+        _cleanup_(closep) int fd = -1;
+        struct sockaddr_un sa = {
+                .sun_family = AF_UNIX,
+        };
+        struct epoll_event ev = {};
+        int64_t i;
+        int one = 1;
+        int length;
+
+        length = snprintf(sa.sun_path + 1, sizeof(sa.sun_path) - 1, "com.redhat.resolver/notify/%i", getpid());
+
+        if (state && varlink_object_get_int(state, "ready_fd", &i) >= 0 && fcntl(i, F_SETFD, FD_CLOEXEC) >= 0) {
+                fd = i;
+        } else {
+                fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (fd < 0)
+                        return -errno;
+
+                if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) < 0)
+                        return -errno;
+
+                if (bind(fd, (struct sockaddr *)&sa, offsetof(struct sockaddr_un, sun_path) + 1 + length) < 0)
+                        return -errno;
+        }
+
+        if (asprintf(&m->ready_socket, "NOTIFY_SOCKET=@%s", sa.sun_path + 1) < 0) {
+                m->ready_socket = NULL;
+                return -ENOMEM;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                free(m->ready_socket);
+                m->ready_socket = NULL;
+                return -errno;
+        }
+
+        m->ready_fd = fd;
+        fd = -1;
+
+        return 0;
+}
+
+/* The message is a list of assignments, one per line. */
+static bool notify_message_is_ready(const char *message) {
+        for (;;) {
+                unsigned long length = strcspn(message, "\n");
+
+                if (length == 7 && strncmp(message, "READY=1", 7) == 0)
+                        return true;
+
+                if (message[length] == '\0')
+                        return false;
+
+                message += length + 1;
+        }
+}
+
+/* Only the main process of an instance is known, messages of other processes are ignored. */
+static long manager_process_ready(Manager *m) {
+        for (;;) {
+                char buffer[4096];
+                union {
+                        struct cmsghdr header;
+                        char data[CMSG_SPACE(sizeof(struct ucred))];
+                } control = {};
+                struct iovec iov = {
+                        .iov_base = buffer,
+                        .iov_len = sizeof(buffer) - 1,
+                };
+                struct msghdr msg = {
+                        .msg_iov = &iov,
+                        .msg_iovlen = 1,
+                        .msg_control = &control,
+                        .msg_controllen = sizeof(control),
+                };
+                struct ucred *ucred = NULL;
+                ServiceInstance *instance;
+                long n;
+
+                /* Passed fds do not fit into the control buffer, the kernel closes them. */
+                n = recvmsg(m->ready_fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        if (errno == EAGAIN)
+                                break;
+
+                        return -errno;
+                }
+
+                for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+                        if (cmsg->cmsg_level == SOL_SOCKET &&
+                            cmsg->cmsg_type == SCM_CREDENTIALS &&
+                            cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred)))
+                                ucred = (struct ucred *)CMSG_DATA(cmsg);
+
+                buffer[n] = '\0';
+                if (!ucred || ucred->pid <= 0 || !notify_message_is_ready(buffer))
+                        continue;
+
+                if (manager_find_instance_by_pid(m, &instance, ucred->pid) < 0)
+                        continue;
+
+                manager_instance_ready(m, instance);
+        }
+
+        return 0;
+}
+
+/*
+ * The state handed over to the new binary across execve(). The listen
+ * sockets are passed as inherited fds, the running services stay our
+ * children, and the deadlines are CLOCK_MONOTONIC, which continues.
+ */
+static long manager_serialize(Manager *m, VarlinkObject **statep) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *state = NULL;
+        _cleanup_(varlink_array_unrefp) VarlinkArray *servicesv = NULL;
+        long r;
+
+        varlink_object_new(&state);
+        varlink_object_set_int(state, "listen_fd", m->listen_fd);
+        if (m->ready_fd >= 0)
+                varlink_object_set_int(state, "ready_fd", m->ready_fd);
+        if (m->path_to_unlink)
+                varlink_object_set_string(state, "path_to_unlink", m->path_to_unlink);
+
+        if (m->index->vendor)
+                varlink_object_set_string(state, "vendor", m->index->vendor);
+        if (m->index->product)
+                varlink_object_set_string(state, "product", m->index->product);
+        if (m->index->version)
+                varlink_object_set_string(state, "version", m->index->version);
+        if (m->index->url)
+                varlink_object_set_string(state, "url", m->index->url);
+
+        varlink_array_new(&servicesv);
+        for (unsigned long s = 0; s < m->n_services; s += 1) {
+                Service *service = m->services[s];
+                _cleanup_(varlink_object_unrefp) VarlinkObject *entryv = NULL;
+                _cleanup_(varlink_object_unrefp) VarlinkObject *servicev = NULL;
+                _cleanup_(varlink_array_unrefp) VarlinkArray *instancesv = NULL;
+
+                r = service_to_object(service, &servicev);
+                if (r < 0)
+                        return r;
+
+                varlink_object_new(&entryv);
+                varlink_object_set_object(entryv, "service", servicev);
+                varlink_object_set_bool(entryv, "configured", service->configured);
+
+                if (service->listen_fd >= 0)
+                        varlink_object_set_int(entryv, "listen_fd", service->listen_fd);
+                if (service->path_to_unlink)
+                        varlink_object_set_string(entryv, "path_to_unlink", service->path_to_unlink);
+
+                if (service->n_running > 0) {
+                        varlink_object_set_int(entryv, "started_usec", service->started_usec);
+                        varlink_object_set_int(entryv, "used_usec", __atomic_load_n(&service->used_usec, __ATOMIC_RELAXED));
+                        varlink_object_set_bool(entryv, "stopping", service->stopping);
+                        varlink_object_set_int(entryv, "stopped_usec", service->stopped_usec);
+                }
+
+                varlink_array_new(&instancesv);
+                for (unsigned long i = 0; i < service->n_instances_max; i += 1) {
+                        ServiceInstance *instance = &service->instances[i];
+                        _cleanup_(varlink_object_unrefp) VarlinkObject *instancev = NULL;
+
+                        varlink_object_new(&instancev);
+                        if (instance->pid > 0) {
+                                varlink_object_set_int(instancev, "pid", instance->pid);
+                                varlink_object_set_int(instancev, "started_usec", instance->started_usec);
+                                varlink_object_set_int(instancev, "exec_usec", instance->exec_usec);
+                                varlink_object_set_int(instancev, "ready_usec", instance->ready_usec);
+                        }
+
+                        varlink_object_set_int(instancev, "n_failures", instance->n_failures);
+                        if (instance->failed && instance->restart_index != PRIOQ_INDEX_NULL)
+                                varlink_object_set_int(instancev, "restart_usec",
+                                                       m->restarts->items[instance->restart_index].priority);
+
+                        r = varlink_array_append_object(instancesv, instancev);
+                        if (r < 0)
+                                return r;
+                }
+
+                varlink_object_set_array(entryv, "instances", instancesv);
+
+                r = varlink_array_append_object(servicesv, entryv);
+                if (r < 0)
+                        return r;
+        }
+
+        varlink_object_set_array(state, "services", servicesv);
+
+        *statep = state;
+        state = NULL;
+
+        return 0;
+}
+
+static void manager_set_inherit(Manager *m, bool inherit) {
+        int flags = inherit ? 0 : FD_CLOEXEC;
+
+        fcntl(m->listen_fd, F_SETFD, flags);
+        if (m->ready_fd >= 0)
+                fcntl(m->ready_fd, F_SETFD, flags);
+
+        for (unsigned long s = 0; s < m->n_services; s += 1)
+                if (m->services[s]->listen_fd >= 0)
+                        fcntl(m->services[s]->listen_fd, F_SETFD, flags);
+}
+
+/*
+ * Executes our binary again, which picks up the serialized state from a
+ * memfd. Connections queued on the listen sockets wait for the new
+ * binary, calls in progress are closed. Returns only on failure, and
+ * keeps running as before.
+ */
+static long manager_reexec(Manager *m) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *state = NULL;
+        _cleanup_(freep) char *json = NULL;
+        _cleanup_(closep) int fd = -1;
+        _cleanup_(freep) char **argv = NULL;
+        _cleanup_(freep) char *deserialize = NULL;
+        unsigned long n_argv = 0;
+        long length;
+        long r;
+
+        if (!m->executable)
+                return -ENOENT;
+
+        r = manager_serialize(m, &state);
+        if (r < 0)
+                return r;
+
+        length = varlink_object_to_json(state, &json);
+        if (length < 0)
+                return length;
+
+        fd = memfd_create("resolver-state", MFD_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        r = write_all(fd, json, length);
+        if (r < 0)
+                return r;
+
+        if (lseek(fd, 0, SEEK_SET) < 0)
+                return -errno;
+
+        if (asprintf(&deserialize, "--deserialize=%i", fd) < 0) {
+                deserialize = NULL;
+                return -ENOMEM;
+        }
+
+        while (m->argv[n_argv])
+                n_argv += 1;
+
+        argv = calloc(n_argv + 2, sizeof(char *));
+        if (!argv)
+                return -ENOMEM;
+
+        /* A previous handover is replaced by this one. */
+        n_argv = 0;
+        for (char **arg = m->argv; *arg; arg += 1)
+                if (strncmp(*arg, "--deserialize=", 14) != 0)
+                        argv[n_argv++] = *arg;
+        argv[n_argv] = deserialize;
+
+        manager_set_inherit(m, true);
+        fcntl(fd, F_SETFD, 0);
+
+        /* The signals stay blocked, pending ones are delivered to the new binary. */
+        execv(m->executable, argv);
+        r = -errno;
+
+        manager_set_inherit(m, false);
+
+        return r;
+}
+
+/* An exit while we were executed is pending as SIGCHLD, or shows in the pidfd. */
+static long manager_deserialize_instance(Manager *m, ServiceInstance *instance, VarlinkObject *instancev) {
+        int64_t i;
+
+        if (varlink_object_get_int(instancev, "n_failures", &i) >= 0)
+                instance->n_failures = i;
+
+        if (varlink_object_get_int(instancev, "pid", &i) >= 0 && i > 0) {
+                instance->pid = i;
+                instance->pid_fd = spawn_pidfd_open(i);
+
+                if (varlink_object_get_int(instancev, "started_usec", &i) >= 0)
+                        instance->started_usec = i;
+                if (varlink_object_get_int(instancev, "exec_usec", &i) >= 0)
+                        instance->exec_usec = i;
+                if (varlink_object_get_int(instancev, "ready_usec", &i) >= 0)
+                        instance->ready_usec = i;
+
+                return manager_watch_process(m, instance);
+        }
+
+        if (varlink_object_get_int(instancev, "restart_usec", &i) >= 0 && i > 0) {
+                instance->failed = true;
+
+                return prioq_put(m->restarts, instance, i, &instance->restart_index);
+        }
+
+        return 0;
+}
+
+/* Takes over a service from the previous binary, with its socket, children and restart deadlines. */
+static long manager_deserialize_service(Manager *m, VarlinkObject *entryv) {
+        _cleanup_(service_freep) Service *service = NULL;
+        Service *s;
+        VarlinkObject *servicev;
+        VarlinkArray *instancesv;
+        const char *path;
+        int64_t i;
         long r;
 
-        r = varlink_object_get_array(parameters, "services", &servicesv);
+        r = varlink_object_get_object(entryv, "service", &servicev);
         if (r < 0)
                 return r;
 
-        n_services = varlink_array_get_n_elements(servicesv);
-        if (n_services < 0)
-                return n_services;
+        r = service_new_from_object(&service, servicev);
+        if (r < 0)
+                return r;
 
-        for (long s = 0; s < n_services; s += 1) {
-                _cleanup_(varlink_object_unrefp) VarlinkObject *servicev = NULL;
-                _cleanup_(varlink_object_unrefp) VarlinkObject *executablev = NULL;
-                _cleanup_(varlink_array_unrefp) VarlinkArray *interfacesv = NULL;
-                const char *address;
-                const char *executable = NULL;
-                uid_t uid = (uid_t)-1;
-                gid_t gid = (gid_t)-1;
-                bool activate = false;
-                _cleanup_(freep) const char **interfaces = NULL;
-                unsigned long n_interfaces;
-                _cleanup_(service_freep) Service *service = NULL;
-                Service *service_old;
+        varlink_object_get_bool(entryv, "configured", &service->configured);
 
-                r = varlink_array_get_object(servicesv, s, &servicev);
-                if (r < 0)
-                        return r;
+        if (varlink_object_get_int(entryv, "listen_fd", &i) >= 0 && fcntl(i, F_SETFD, FD_CLOEXEC) >= 0) {
+                service->listen_fd = i;
 
-                if (varlink_object_get_string(servicev, "address", &address) < 0)
-                        return -EUCLEAN;
+                if (varlink_object_get_string(entryv, "path_to_unlink", &path) >= 0) {
+                        service->path_to_unlink = strdup(path);
+                        if (!service->path_to_unlink)
+                                return -ENOMEM;
+                }
+        }
 
-                if (varlink_object_get_object(servicev, "executable", &executablev) >= 0) {
-                        int64_t i;
+        /* A socket which did not make it is created again. */
+        r = service_listen(service);
+        if (r < 0)
+                return r;
 
-                        r = varlink_object_get_string(executablev, "path", &executable);
-                        if (r < 0)
-                                return r;
+        if (varlink_object_get_int(entryv, "started_usec", &i) >= 0)
+                service->started_usec = i;
+        if (varlink_object_get_int(entryv, "used_usec", &i) >= 0)
+                service->used_usec = i;
+        if (varlink_object_get_int(entryv, "stopped_usec", &i) >= 0)
+                service->stopped_usec = i;
+        varlink_object_get_bool(entryv, "stopping", &service->stopping);
 
-                        if (varlink_object_get_int(servicev, "user_id", &i) >= 0)
-                                uid = i;
+        r = manager_add_service(m, service);
+        if (r < 0)
+                return r;
 
-                        if (varlink_object_get_int(servicev, "group_id", &i) >= 0)
-                                gid = i;
-                }
+        s = service;
+        service = NULL;
 
-                varlink_object_get_bool(executablev, "activate_at_startup", &activate);
+        /* A binary without instances kept the state of its single child in the entry. */
+        if (varlink_object_get_array(entryv, "instances", &instancesv) >= 0) {
+                long n_instances = varlink_array_get_n_elements(instancesv);
 
-                r = varlink_object_get_array(servicev, "interfaces", &interfacesv);
-                if (r < 0)
-                        return r;
+                for (long k = 0; k < n_instances && (unsigned long)k < s->n_instances_max; k += 1) {
+                        VarlinkObject *instancev;
 
-                n_interfaces = varlink_array_get_n_elements(interfacesv);
-                interfaces = malloc(n_interfaces * sizeof(char *));
-                for (unsigned long i = 0; i < n_interfaces; i += 1) {
-                        r = varlink_array_get_string(interfacesv, i, &interfaces[i]);
+                        r = varlink_array_get_object(instancesv, k, &instancev);
                         if (r < 0)
                                 return r;
-                }
-
-                r = service_new(&service,
-                                address,
-                                interfaces, n_interfaces,
-                                executable,
-                                uid, gid,
-                                activate,
-                                NULL);
-                if (r < 0)
-                        return r;
 
-                r = manager_find_service_by_address(m, &service_old, service->address);
-                if (r >= 0) {
-                        r = manager_remove_service(m, service_old);
+                        r = manager_deserialize_instance(m, &s->instances[k], instancev);
                         if (r < 0)
                                 return r;
                 }
-
-                r = manager_add_service(m, service);
+        } else {
+                r = manager_deserialize_instance(m, &s->instances[0], entryv);
                 if (r < 0)
                         return r;
-
-                service = NULL;
         }
 
-        r = manager_update_interface_index(m);
+        r = manager_update_watch(m, s);
         if (r < 0)
                 return r;
 
-        return varlink_call_reply(call, NULL, 0);
-}
-
-static long manager_activate_service(Manager *m, Service *service) {
-        assert(service->pid < 0);
+        if (s->n_running > 0 && !s->stopping) {
+                r = manager_schedule_idle(m, s);
+                if (r < 0)
+                        return r;
 
-        manager_unwatch_service(m, service);
+                r = manager_schedule_pressure(m, s);
+                if (r < 0)
+                        return r;
+        }
 
-        return service_activate(service, &m->oldmask);
+        return manager_arm_timer(m);
 }
 
-static long manager_activate_configured_services(Manager *m) {
+/* A service which cannot be restored is skipped, the first error is returned. */
+static long manager_deserialize(Manager *m, VarlinkObject *state) {
+        VarlinkArray *servicesv;
+        const char *info[4] = {};
+        long n_services;
+        long error = 0;
         long r;
 
-        for (unsigned long i = 0; i < m->n_services; i += 1) {
-                Service *service = m->services[i];
+        varlink_object_get_string(state, "vendor", &info[0]);
+        varlink_object_get_string(state, "product", &info[1]);
+        varlink_object_get_string(state, "version", &info[2]);
+        varlink_object_get_string(state, "url", &info[3]);
+        interface_index_set_info(m->index, info[0], info[1], info[2], info[3]);
 
-                if (!service->activate_at_startup)
-                        continue;
+        r = varlink_object_get_array(state, "services", &servicesv);
+        if (r < 0)
+                return r;
 
-                r = manager_activate_service(m, service);
-                if (r < 0)
-                        return r;
+        n_services = varlink_array_get_n_elements(servicesv);
+        if (n_services < 0)
+                return n_services;
+
+        for (long s = 0; s < n_services; s += 1) {
+                VarlinkObject *entryv;
+
+                r = varlink_array_get_object(servicesv, s, &entryv);
+                if (r >= 0)
+                        r = manager_deserialize_service(m, entryv);
+                if (r < 0) {
+                        fprintf(stderr, "Error: restoring service: %s.\n", strerror(-r));
+                        if (error == 0)
+                                error = r;
+                }
         }
 
-        return 0;
+        return error;
 }
 
-static long manager_reset_failed_services(Manager *m) {
+/* Reads the state and our listen socket from the fd, which is closed. */
+static long manager_read_state(Manager *m, int fd, VarlinkObject **statep, int *listen_fdp) {
+        _cleanup_(closep) int state_fd = fd;
+        _cleanup_(freep) char *json = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *state = NULL;
+        unsigned long size;
+        const char *path;
+        int64_t i;
         long r;
 
-        for (unsigned long i = 0; i < m->n_services; i += 1) {
-                Service *service = m->services[i];
+        r = read_file(state_fd, &json, &size);
+        if (r < 0)
+                return r;
 
-                if (!service->failed)
-                        continue;
+        r = varlink_object_new_from_json(&state, json);
+        if (r < 0)
+                return r;
 
-                service->failed = false;
+        if (varlink_object_get_int(state, "listen_fd", &i) < 0 || fcntl(i, F_SETFD, FD_CLOEXEC) < 0)
+                return -EBADF;
 
-                r = manager_watch_service(m, service);
-                if (r < 0)
-                        return r;
+        if (varlink_object_get_string(state, "path_to_unlink", &path) >= 0) {
+                m->path_to_unlink = strdup(path);
+                if (!m->path_to_unlink)
+                        return -ENOMEM;
         }
 
+        *listen_fdp = i;
+        *statep = state;
+        state = NULL;
+
         return 0;
 }
 
-static long manager_read_config(Manager *m, const char *config) {
-        _cleanup_(fclosep) FILE *f = NULL;
-        char json[0xffff];
-        _cleanup_(varlink_object_unrefp) VarlinkObject *configv = NULL;
-        const char *str;
-        VarlinkArray *servicesv;
-        long n_services;
+static long manager_process_signals(Manager *m, bool *exitp) {
+        struct signalfd_siginfo fdsi;
+        long size;
         long r;
 
-        f = fopen(config, "re");
-        if (!f) {
-                /* treat no file the same as '{}' */
-                if (errno == ENOENT)
-                        return 0;
+        size = read(m->signal_fd, &fdsi, sizeof(struct signalfd_siginfo));
+        if (size != sizeof(struct signalfd_siginfo))
+                return 0;
 
-                return -errno;
-        }
+        switch (fdsi.ssi_signo) {
+                case SIGTERM:
+                case SIGINT:
+                        *exitp = true;
+                        break;
 
-        r = fread(json, 1, sizeof(json), f);
-        if (r == 0)
-                return -ferror(f);
+                case SIGHUP:
+                        if (m->config)
+                                manager_reload_config(m);
+                        break;
 
-        if (r == sizeof(json))
-                return -EFBIG;
+                /* Executed after the current batch of events. */
+                case SIGUSR2:
+                        m->reexec = true;
+                        break;
 
-        json[r - 1] = '\0';
+                case SIGCHLD:
+                        for (;;) {
+                                siginfo_t si = {};
+                                ServiceInstance *instance;
 
-        r = varlink_object_new_from_json(&configv, json);
-        if (r < 0)
-                return r;
+                                if (waitid(P_ALL, 0, &si, WEXITED|WNOHANG) < 0) {
+                                        if (errno == EINTR)
+                                                continue;
 
-        if (varlink_object_get_string(configv, "vendor", &str) >= 0)
-                m->vendor = strdup(str);
+                                        if (errno == ECHILD)
+                                                break;
 
-        if (varlink_object_get_string(configv, "product", &str) >= 0)
-                m->product = strdup(str);
+                                        return -errno;
+                                }
 
-        if (varlink_object_get_string(configv, "version", &str) >= 0)
-                m->version = strdup(str);
+                                if (si.si_pid < 0)
+                                        return -EIO;
 
-        if (varlink_object_get_string(configv, "url", &str) >= 0)
-                m->url = strdup(str);
+                                if (si.si_pid == 0)
+                                        break;
 
-        r = varlink_object_get_array(configv, "services", &servicesv);
-        if (r < 0)
-                return r;
+                                r = manager_find_instance_by_pid(m, &instance, si.si_pid);
+                                if (r < 0) {
+                                        /* Removed service, a spawner, or an orphan we inherited. */
+                                        if (r == -ESRCH) {
+                                                manager_forget_spawner(m, si.si_pid);
+                                                continue;
+                                        }
 
-        n_services = varlink_array_get_n_elements(servicesv);
-        if (n_services < 0)
-                return n_services;
+                                        return r;
+                                }
 
-        for (long s = 0; s < n_services; s += 1) {
-                VarlinkObject *servicev;
-                VarlinkObject *executablev;
-                VarlinkArray *interfacesv;
-                const char *address;
-                _cleanup_(freep) const char **interfaces = NULL;
-                unsigned long n_interfaces;
-                const char *executable = NULL;
-                uid_t uid = (uid_t)-1;
-                gid_t gid = (gid_t)-1;
-                bool activate = false;
-                _cleanup_(service_freep) Service *service = NULL;
+                                r = manager_instance_exited(m, instance, &si);
+                                if (r < 0)
+                                        return r;
+                        }
 
-                r = varlink_array_get_object(servicesv, s, &servicev);
-                if (r < 0)
-                        return r;
+                        break;
 
-                if (varlink_object_get_string(servicev, "address", &address) < 0)
-                        return -EUCLEAN;
+                default:
+                        abort();
+        }
+
+        return 0;
+}
+
+static long manager_process_events(Manager *m, struct epoll_event *events, int n, bool *exitp) {
+        bool process_varlink = false;
+        long r;
 
-                if (varlink_object_get_object(servicev, "executable", &executablev) >= 0) {
-                        int64_t i;
+        for (int e = 0; e < n; e += 1) {
+                if (events[e].data.fd == varlink_service_get_fd(m->service)) {
+                        process_varlink = true;
 
-                        r = varlink_object_get_string(executablev, "path", &executable);
+                } else if (events[e].data.fd == m->signal_fd) {
+                        r = manager_process_signals(m, exitp);
                         if (r < 0)
                                 return r;
 
-                        if (varlink_object_get_int(servicev, "user_id", &i) >= 0)
-                                uid = i;
-
-                        if (varlink_object_get_int(servicev, "group_id", &i) >= 0)
-                                gid = i;
-                }
-
-                varlink_object_get_bool(servicev, "activate_at_startup", &activate);
+                } else if (events[e].data.fd == m->timer_fd) {
+                        r = manager_process_timer(m);
+                        if (r < 0)
+                                return r;
 
-                r = varlink_object_get_array(servicev, "interfaces", &interfacesv);
-                if (r < 0)
-                        return r;
+                } else if (events[e].data.fd == m->inotify_fd) {
+                        r = manager_process_inotify(m);
+                        if (r < 0)
+                                return r;
 
-                n_interfaces = varlink_array_get_n_elements(interfacesv);
-                interfaces = malloc(n_interfaces * sizeof(char *));
-                for (unsigned long i = 0; i < n_interfaces; i += 1) {
-                        r = varlink_array_get_string(interfacesv, i, &interfaces[i]);
+                } else if (events[e].data.fd == m->ready_fd) {
+                        r = manager_process_ready(m);
                         if (r < 0)
                                 return r;
-                }
 
-                r = service_new(&service,
-                                address,
-                                interfaces, n_interfaces,
-                                executable,
-                                uid, gid,
-                                activate,
-                                NULL);
-                if (r < 0)
-                        return r;
+                } else if (events[e].data.fd == m->failed_fd) {
+                        fprintf(stderr, "Error: a worker thread stopped.\n");
+                        return -EIO;
 
-                r = manager_add_service(m, service);
-                if (r < 0)
-                        return r;
+                } else if (events[e].data.fd == m->notify_fd) {
+                        eventfd_t value;
+
+                        eventfd_read(m->notify_fd, &value);
+                        subscription_list_notify(&m->subscriptions, m->index);
+
+                } else {
+                        ServiceWatch *watch = events[e].data.ptr;
+                        ServiceInstance *instance;
+                        Service *service;
+
+                        switch (*watch) {
+                                case SERVICE_WATCH_LISTEN:
+                                        service = container_of(watch, Service, listen_watch);
+                                        if (service->removed)
+                                                break;
+
+                                        r = manager_activate_service(m, service);
+                                        if (r < 0)
+                                                return r;
+                                        break;
+
+                                case SERVICE_WATCH_PROCESS:
+                                        instance = container_of(watch, ServiceInstance, process_watch);
+                                        if (instance->service->removed)
+                                                break;
 
-                service = NULL;
+                                        r = manager_process_instance_exit(m, instance);
+                                        if (r < 0)
+                                                return r;
+                                        break;
+
+                                case SERVICE_WATCH_EXEC:
+                                        instance = container_of(watch, ServiceInstance, exec_watch);
+                                        if (instance->service->removed || instance->exec_fd < 0)
+                                                break;
+
+                                        manager_instance_executed(m, instance);
+                                        break;
+
+                                default:
+                                        abort();
+                        }
+                }
+        }
+
+        /*
+         * Varlink calls can remove services, the remaining events of
+         * this batch might point to them; handle the calls last.
+         */
+        if (process_varlink) {
+                r = varlink_service_process_events(m->service);
+                switch(r) {
+                        case 0:
+                        case -VARLINK_ERROR_CANNOT_ACCEPT:
+                        case -VARLINK_ERROR_CONNECTION_CLOSED:
+                                break;
+
+                        default:
+                                fprintf(stderr, "Error processing events: %s\n", varlink_error_string(-r));
+                                return r;
+                }
         }
 
         return 0;
@@ -606,6 +2935,12 @@ int main(int argc, char **argv) {
         static const struct option options[] = {
                 { "config",  required_argument, NULL, 'c' },
                 { "varlink", required_argument, NULL, 'v' },
+                { "max-events", required_argument, NULL, 'e' },
+                { "threads", required_argument, NULL, 't' },
+                { "spawners", required_argument, NULL, 's' },
+                { "max-running", required_argument, NULL, 'r' },
+                { "snapshot", required_argument, NULL, 'S' },
+                { "deserialize", required_argument, NULL, 'D' },
                 { "help",    no_argument,       NULL, 'h' },
                 {}
         };
@@ -614,10 +2949,16 @@ int main(int argc, char **argv) {
         const char *address = NULL;
         const char *config = NULL;
         int fd = -1;
+        int state_fd = -1;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *state = NULL;
         sigset_t mask;
         struct epoll_event ev = {};
+        _cleanup_(freep) struct epoll_event *events = NULL;
+        int max_events = 64;
+        long n_workers = 0;
+        long n_spawners = 0;
+        long n_running_max = 0;
         bool exit = false;
-        int timeout = -1;
         long r;
 
         r = manager_new(&m);
@@ -630,10 +2971,57 @@ int main(int argc, char **argv) {
                                 config = optarg;
                                 break;
 
+                        case 'D':
+                                state_fd = strtol(optarg, NULL, 10);
+                                break;
+
+                        case 'e':
+                                max_events = strtol(optarg, NULL, 10);
+                                if (max_events <= 0) {
+                                        fprintf(stderr, "Error: invalid number of events: %s\n", optarg);
+                                        return EXIT_FAILURE;
+                                }
+                                break;
+
                         case 'h':
-                                printf("Usage: %s --varlink=URI\n\n", program_invocation_short_name);
+                                /* --deserialize=FD is internal, only the previous binary passes it on SIGUSR2. */
+                                printf("Usage: %s --varlink=URI [--config=PATH] [--max-events=N] [--threads=N] [--spawners=N] [--max-running=N]\n"
+                                       "       [--snapshot=PATH]\n\n",
+                                       program_invocation_short_name);
                                 return EXIT_SUCCESS;
 
+                        case 'r':
+                                n_running_max = strtol(optarg, NULL, 10);
+                                if (n_running_max < 0) {
+                                        fprintf(stderr, "Error: invalid number of running services: %s\n", optarg);
+                                        return EXIT_FAILURE;
+                                }
+                                break;
+
+                        case 'S':
+                                m->snapshot = strdup(optarg);
+                                if (!m->snapshot)
+                                        return EXIT_FAILURE;
+                                break;
+
+                        case 's':
+                                n_spawners = strtol(optarg, NULL, 10);
+                                if (n_spawners < 0 || n_spawners > SPAWNERS_MAX) {
+                                        fprintf(stderr, "Error: invalid number of spawners: %s\n", optarg);
+                                        return EXIT_FAILURE;
+                                }
+                                break;
+
+                        case 't':
+                                n_workers = strtol(optarg, NULL, 10);
+                                if (n_workers < 0 || n_workers > WORKERS_MAX) {
+                                        fprintf(stderr, "Error: invalid number of threads: %s\n", optarg);
+                                        return EXIT_FAILURE;
+                                }
+
+                                m->n_threads = n_workers + 1;
+                                break;
+
                         case 'v':
                                 address = optarg;
                                 break;
@@ -645,10 +3033,31 @@ int main(int argc, char **argv) {
                 return EXIT_FAILURE;
         }
 
+        m->argv = argv;
+        m->executable = realpath("/proc/self/exe", NULL);
+
+        /* The previous binary passed us its state and listen socket. */
+        if (state_fd >= 0) {
+                r = manager_read_state(m, state_fd, &state, &fd);
+                if (r < 0) {
+                        fprintf(stderr, "Error: reading state: %s.\n", strerror(-r));
+
+                        return EXIT_FAILURE;
+                }
+
         /* An activator passed us our listen socket. */
-        if (read(3, NULL, 0) == 0)
+        } else if (read(3, NULL, 0) == 0)
                 fd = 3;
 
+        /* Workers share the listen socket, and a re-execution hands it over; we need to own it. */
+        if (fd < 0) {
+                fd = varlink_listen(address, &m->path_to_unlink);
+                if (fd < 0)
+                        return EXIT_FAILURE;
+        }
+
+        m->listen_fd = fd;
+
         r = varlink_service_new(&m->service,
                                 "Varlink",
                                 "Resolver",
@@ -659,17 +3068,7 @@ int main(int argc, char **argv) {
         if (r < 0)
                 return EXIT_FAILURE;
 
-        r = varlink_service_add_interface(m->service, org_varlink_resolver_varlink,
-                                          "Resolve", org_varlink_resolver_Resolve, m,
-                                          "GetInfo", org_varlink_resolver_GetInfo, m,
-                                          NULL);
-        if (r < 0)
-                return EXIT_FAILURE;
-
-        r = varlink_service_add_interface(m->service, com_redhat_resolver_varlink,
-                                          "GetConfig", com_redhat_resolver_GetConfig, m,
-                                          "AddServices", com_redhat_resolver_AddServices, m,
-                                          NULL);
+        r = manager_add_interfaces(m, m->service);
         if (r < 0)
                 return EXIT_FAILURE;
 
@@ -686,8 +3085,16 @@ int main(int argc, char **argv) {
         sigaddset(&mask, SIGCHLD);
         sigaddset(&mask, SIGINT);
         sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGHUP);
+        sigaddset(&mask, SIGUSR2);
         sigprocmask(SIG_BLOCK, &mask, &m->oldmask);
 
+        /* The previous binary executed us with these signals blocked, children get them unblocked. */
+        if (state)
+                for (int sig = 1; sig < NSIG; sig += 1)
+                        if (sigismember(&mask, sig) == 1)
+                                sigdelset(&m->oldmask, sig);
+
         m->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
         if (m->signal_fd < 0)
                 return EXIT_FAILURE;
@@ -697,141 +3104,148 @@ int main(int argc, char **argv) {
         if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, m->signal_fd, &ev) < 0)
                 return EXIT_FAILURE;
 
-        if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0)
+        m->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (m->timer_fd < 0)
                 return EXIT_FAILURE;
 
-        if (config) {
-                r = manager_read_config(m, config);
-                if (r < 0) {
-                        fprintf(stderr, "Error: reading configuration: %s.\n", strerror(-r));
+        ev.events = EPOLLIN;
+        ev.data.fd = m->timer_fd;
+        if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, m->timer_fd, &ev) < 0)
+                return EXIT_FAILURE;
 
-                        return EXIT_FAILURE;
-                }
-        }
+        m->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m->notify_fd < 0)
+                return EXIT_FAILURE;
 
-        r = manager_update_interface_index(m);
-        if (r < 0)
+        ev.events = EPOLLIN;
+        ev.data.fd = m->notify_fd;
+        if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, m->notify_fd, &ev) < 0)
                 return EXIT_FAILURE;
 
-        r = manager_activate_configured_services(m);
-        if (r < 0)
+        srandom(now_usec() ^ getpid());
+
+        if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0)
                 return EXIT_FAILURE;
 
-        while (!exit) {
-                int n;
+        /* Not fatal, the services are started without NOTIFY_SOCKET. */
+        r = manager_open_ready_socket(m, state);
+        if (r < 0)
+                fprintf(stderr, "Warning: opening notify socket: %s.\n", strerror(-r));
 
-                n = epoll_wait(m->epoll_fd, &ev, 1, timeout);
-                if (n < 0) {
-                        if (errno == EINTR)
-                                continue;
+        m->n_spawners_max = n_spawners;
+        r = manager_start_spawners(m);
+        if (r < 0) {
+                fprintf(stderr, "Error: starting spawners: %s.\n", strerror(-r));
 
-                        return EXIT_FAILURE;
-                }
+                return EXIT_FAILURE;
+        }
 
-                if (n == 0) {
-                        timeout = -1;
+        /* Not fatal, the services which were restored keep running. */
+        if (state) {
+                r = manager_deserialize(m, state);
+                if (r < 0)
+                        fprintf(stderr, "Error: restoring state: %s.\n", strerror(-r));
+        }
 
-                        r = manager_reset_failed_services(m);
-                        if (r < 0)
-                                return r;
+        if (config) {
+                m->config = strdup(config);
+                if (!m->config)
+                        return EXIT_FAILURE;
 
-                        continue;
-                }
+                /*
+                 * A snapshot which failed halfway is fine, reading the file
+                 * applies the difference. After a re-execution, the services
+                 * were restored already.
+                 */
+                r = m->snapshot && !state ? manager_read_snapshot(m) : -ENOENT;
+                m->stats.config_from_snapshot = r >= 0;
+                if (r < 0 && !state) {
+                        struct stat st;
 
-                if (ev.data.fd == varlink_service_get_fd(m->service)) {
-                        r = varlink_service_process_events(m->service);
-                        switch(r) {
-                                case 0:
-                                case -VARLINK_ERROR_CANNOT_ACCEPT:
-                                case -VARLINK_ERROR_CONNECTION_CLOSED:
-                                        break;
+                        if (r != -ENOENT && r != -ESTALE)
+                                fprintf(stderr, "Warning: ignoring snapshot: %s.\n", strerror(-r));
 
-                                default:
-                                        fprintf(stderr, "Error processing events: %s\n", varlink_error_string(-r));
-                                        return EXIT_FAILURE;
-                        }
+                        r = manager_read_config(m, config, false, &st);
+                        if (r < 0) {
+                                fprintf(stderr, "Error: reading configuration: %s.\n", strerror(-r));
 
-                } else if (ev.data.fd == m->signal_fd) {
-                        struct signalfd_siginfo fdsi;
-                        long size;
+                                return EXIT_FAILURE;
+                        }
 
-                        size = read(m->signal_fd, &fdsi, sizeof(struct signalfd_siginfo));
-                        if (size != sizeof(struct signalfd_siginfo))
-                                continue;
+                        manager_write_snapshot(m, &st);
+                }
 
-                        switch (fdsi.ssi_signo) {
-                                case SIGTERM:
-                                case SIGINT:
-                                        exit = true;
-                                        break;
+                /* SIGHUP still reloads the configuration without it. */
+                r = manager_watch_config(m);
+                if (r < 0)
+                        fprintf(stderr, "Warning: watching configuration: %s.\n", strerror(-r));
+        }
 
-                                case SIGCHLD:
-                                        for (;;) {
-                                                siginfo_t si = {};
-                                                Service *service;
+        m->n_running_max = n_running_max;
+        r = manager_refill_spawners(m);
+        if (r < 0) {
+                fprintf(stderr, "Error: starting spawners: %s.\n", strerror(-r));
 
-                                                if (waitid(P_ALL, 0, &si, WEXITED|WNOHANG) < 0) {
-                                                        if (errno == EINTR)
-                                                                continue;
+                return EXIT_FAILURE;
+        }
 
-                                                        if (errno == ECHILD)
-                                                                break;
+        if (!state) {
+                r = manager_activate_configured_services(m);
+                if (r < 0)
+                        return EXIT_FAILURE;
+        }
 
-                                                        return -errno;
-                                                }
+        if (n_workers > 0) {
+                r = manager_start_workers(m, n_workers, address, fd);
+                if (r < 0) {
+                        fprintf(stderr, "Error: starting threads: %s.\n", strerror(-r));
 
-                                                if (si.si_pid < 0)
-                                                        return EXIT_FAILURE;
+                        return EXIT_FAILURE;
+                }
+        }
 
-                                                if (si.si_pid == 0)
-                                                        break;
+        events = calloc(max_events, sizeof(struct epoll_event));
+        if (!events)
+                return EXIT_FAILURE;
 
-                                                r = manager_find_service_by_pid(m, &service, si.si_pid);
-                                                if (r < 0) {
-                                                        if (r == -ESRCH)
-                                                                break;
+        m->stats.startup_usec = now_usec() - m->stats.start_usec;
 
-                                                        return EXIT_FAILURE;
-                                                }
+        while (!exit) {
+                int n;
 
-                                                service->pid = -1;
+                n = epoll_wait(m->epoll_fd, events, max_events, -1);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
 
-                                                if (si.si_code == CLD_EXITED && si.si_status == 0) {
-                                                        r = manager_watch_service(m, service);
-                                                        if (r < 0)
-                                                                return EXIT_FAILURE;
+                        return EXIT_FAILURE;
+                }
 
-                                                        break;
-                                                }
+                pthread_mutex_lock(&m->lock);
+                r = manager_process_events(m, events, n, &exit);
 
-                                                if (si.si_code == CLD_EXITED)
-                                                        fprintf(stderr, "%s: exit code: %s\n", service->executable, strerror(si.si_status));
-                                                else if (si.si_code == CLD_KILLED || si.si_code == CLD_DUMPED)
-                                                        fprintf(stderr, "%s: killed by signal: %s\n", service->executable, strsignal(si.si_status));
-                                                else
-                                                        fprintf(stderr, "%s: status %i:%i\n", service->executable, si.si_code, si.si_status);
+                /* Services removed by workers are freed here as well. */
+                manager_free_retired(m);
 
-                                                if (service_reset(service) < 0)
-                                                        return EXIT_FAILURE;
+                /* Returns only on failure, no worker changes the services meanwhile. */
+                if (r >= 0 && m->reexec) {
+                        long error;
 
-                                                service->failed = true;
-                                                timeout = 1000;
-                                                fprintf(stderr, "%s: disable re-execution for %i msec\n", service->executable, timeout);
-                                        }
+                        m->reexec = false;
 
-                                        break;
+                        error = manager_reexec(m);
+                        fprintf(stderr, "Error: executing the resolver again: %s.\n", strerror(-error));
+                }
 
-                                default:
-                                        abort();
-                        }
+                pthread_mutex_unlock(&m->lock);
 
-                } else {
-                        Service *service = ev.data.ptr;
+                if (r < 0)
+                        return EXIT_FAILURE;
 
-                        r = manager_activate_service(m, service);
-                        if (r < 0)
-                                return EXIT_FAILURE;
-                }
+                /* Activations fall back to clone() without spawners. */
+                r = manager_refill_spawners(m);
+                if (r < 0)
+                        fprintf(stderr, "Error: starting spawners: %s.\n", strerror(-r));
         }
 
         return EXIT_SUCCESS;
@@ -0,0 +1,145 @@
+#include "prioq.h"
+#include "util.h"
+
+#include <errno.h>
+
+long prioq_new(Prioq **qp) {
+        Prioq *q;
+
+        q = calloc(1, sizeof(Prioq));
+        if (!q)
+                return -ENOMEM;
+
+        *qp = q;
+
+        return 0;
+}
+
+Prioq *prioq_free(Prioq *q) {
+        for (unsigned long i = 0; i < q->n_items; i += 1)
+                *q->items[i].indexp = PRIOQ_INDEX_NULL;
+
+        free(q->items);
+        free(q);
+
+        return NULL;
+}
+
+void prioq_freep(Prioq **qp) {
+        if (*qp)
+                prioq_free(*qp);
+}
+
+static void prioq_set(Prioq *q, unsigned long i, PrioqItem *item) {
+        q->items[i] = *item;
+        *item->indexp = i;
+}
+
+static void prioq_shuffle_up(Prioq *q, unsigned long i) {
+        PrioqItem item = q->items[i];
+
+        while (i > 0) {
+                unsigned long parent = (i - 1) / 2;
+
+                if (q->items[parent].priority <= item.priority)
+                        break;
+
+                prioq_set(q, i, &q->items[parent]);
+                i = parent;
+        }
+
+        prioq_set(q, i, &item);
+}
+
+static void prioq_shuffle_down(Prioq *q, unsigned long i) {
+        PrioqItem item = q->items[i];
+
+        for (;;) {
+                unsigned long child = i * 2 + 1;
+
+                if (child >= q->n_items)
+                        break;
+
+                if (child + 1 < q->n_items && q->items[child + 1].priority < q->items[child].priority)
+                        child += 1;
+
+                if (item.priority <= q->items[child].priority)
+                        break;
+
+                prioq_set(q, i, &q->items[child]);
+                i = child;
+        }
+
+        prioq_set(q, i, &item);
+}
+
+long prioq_put(Prioq *q, void *data, uint64_t priority, unsigned long *indexp) {
+        PrioqItem item = {
+                .priority = priority,
+                .data = data,
+                .indexp = indexp,
+        };
+
+        if (*indexp != PRIOQ_INDEX_NULL)
+                prioq_remove(q, indexp);
+
+        if (q->n_items == q->n_items_allocated) {
+                unsigned long n_items_allocated = MAX(q->n_items_allocated * 2, 16UL);
+                PrioqItem *items;
+
+                items = realloc(q->items, n_items_allocated * sizeof(PrioqItem));
+                if (!items)
+                        return -ENOMEM;
+
+                q->items = items;
+                q->n_items_allocated = n_items_allocated;
+        }
+
+        prioq_set(q, q->n_items, &item);
+        q->n_items += 1;
+        prioq_shuffle_up(q, q->n_items - 1);
+
+        return 0;
+}
+
+void prioq_remove(Prioq *q, unsigned long *indexp) {
+        unsigned long i = *indexp;
+        unsigned long *moved_indexp;
+
+        if (i == PRIOQ_INDEX_NULL)
+                return;
+
+        *indexp = PRIOQ_INDEX_NULL;
+        q->n_items -= 1;
+
+        if (i == q->n_items)
+                return;
+
+        /* Move the last item into the hole and restore the heap order. */
+        moved_indexp = q->items[q->n_items].indexp;
+        prioq_set(q, i, &q->items[q->n_items]);
+        prioq_shuffle_down(q, i);
+        prioq_shuffle_up(q, *moved_indexp);
+}
+
+void *prioq_peek(Prioq *q, uint64_t *priorityp) {
+        if (q->n_items == 0)
+                return NULL;
+
+        if (priorityp)
+                *priorityp = q->items[0].priority;
+
+        return q->items[0].data;
+}
+
+void *prioq_pop(Prioq *q) {
+        void *data;
+
+        if (q->n_items == 0)
+                return NULL;
+
+        data = q->items[0].data;
+        prioq_remove(q, q->items[0].indexp);
+
+        return data;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+#define PRIOQ_INDEX_NULL ((unsigned long)-1)
+
+typedef struct {
+        uint64_t priority;
+        void *data;
+        unsigned long *indexp;
+} PrioqItem;
+
+/*
+ * Binary min-heap. Every item carries a pointer to an index in the
+ * owning object, which is kept up-to-date while items move, so items
+ * can be removed or re-prioritized without searching for them.
+ */
+typedef struct {
+        PrioqItem *items;
+        unsigned long n_items;
+        unsigned long n_items_allocated;
+} Prioq;
+
+long prioq_new(Prioq **qp);
+Prioq *prioq_free(Prioq *q);
+void prioq_freep(Prioq **qp);
+long prioq_put(Prioq *q, void *data, uint64_t priority, unsigned long *indexp);
+void prioq_remove(Prioq *q, unsigned long *indexp);
+void *prioq_peek(Prioq *q, uint64_t *priorityp);
+void *prioq_pop(Prioq *q);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <sched.h>
+
+/*
+ * Read-copy-update for a fixed set of reader threads. Every reader owns
+ * a counter, which is odd while the reader is inside a read-side
+ * section. A writer publishes a new version of the data, waits for
+ * every reader which might still see the old version, and frees it.
+ */
+typedef struct {
+        unsigned long counter;
+} RcuReader;
+
+static inline void rcu_read_lock(RcuReader *reader) {
+        __atomic_add_fetch(&reader->counter, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void rcu_read_unlock(RcuReader *reader) {
+        __atomic_add_fetch(&reader->counter, 1, __ATOMIC_RELEASE);
+}
+
+/* Returns when the reader is outside of the section it might be in now. */
+static inline void rcu_wait_for_reader(RcuReader *reader) {
+        unsigned long counter = __atomic_load_n(&reader->counter, __ATOMIC_SEQ_CST);
+
+        if (counter % 2 == 0)
+                return;
+
+        while (__atomic_load_n(&reader->counter, __ATOMIC_ACQUIRE) == counter)
+                sched_yield();
+}
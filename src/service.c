@@ -1,15 +1,31 @@
 #include "service.h"
+#include "spawner.h"
 #include "util.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <string.h>
 #include <signal.h>
-#include <sys/prctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+/* Copies the string to the end of the buffer, and advances it. */
+static char *strings_append(char **bufferp, const char *prefix, const char *string) {
+        char *s = *bufferp;
+
+        *bufferp = stpcpy(stpcpy(s, prefix), string) + 1;
+
+        return s;
+}
+
+/*
+ * The service and all its strings and string arrays live in a single
+ * allocation, laid out in the order they are used: the pointer arrays
+ * first, then the address and the interface names. They are freed
+ * together with the service.
+ */
 long service_new(Service **servicep,
                  const char *address,
                  const char **interfaces, unsigned long n_interfaces,
@@ -19,47 +35,408 @@ long service_new(Service **servicep,
                  bool activate,
                  const char *config) {
         _cleanup_(service_freep) Service *service = NULL;
+        unsigned long n_argv = 0;
+        unsigned long size;
+        char *strings;
+        long r;
 
-        service = calloc(1, sizeof(Service));
-        service->pid = -1;
-        service->address = strdup(address);
+        size = sizeof(Service) + n_interfaces * sizeof(char *);
+        size += strlen(address) + 1;
 
-        service->interfaces = calloc(n_interfaces, sizeof(char *));
         for (unsigned long i = 0; i < n_interfaces; i += 1)
-                service->interfaces[i] = strdup(interfaces[i]);
-        service->n_interfaces = n_interfaces;
+                size += strlen(interfaces[i]) + 1;
 
+        /* executable, --varlink=, --config=, NULL */
         if (executable) {
-                int listen_fd;
-
-                service->executable = strdup(executable);
-                service->argv = calloc(3, sizeof(char *));
-                service->argv[0] = strdup(service->executable);
-                asprintf(&service->argv[1], "--varlink=%s", service->address);
+                n_argv = 4;
+                size += n_argv * sizeof(char *);
+                size += strlen(executable) + 1;
+                size += strlen("--varlink=") + strlen(address) + 1;
 
                 if (config) {
-                        service->config = strdup(config);
-                        asprintf(&service->argv[2], "--config=%s", service->config);
+                        size += strlen(config) + 1;
+                        size += strlen("--config=") + strlen(config) + 1;
                 }
+        }
+
+        service = calloc(1, size);
+        if (!service)
+                return -ENOMEM;
+
+        service->listen_fd = -1;
+        service->listen_watch = SERVICE_WATCH_LISTEN;
+        service->idle_index = PRIOQ_INDEX_NULL;
+        service->pressure_index = PRIOQ_INDEX_NULL;
 
-                listen_fd = varlink_listen(service->address, &service->path_to_unlink);
-                if (listen_fd < 0)
-                        return listen_fd;
+        service->interfaces = (char **)(service + 1);
+        service->n_interfaces = n_interfaces;
+        if (n_argv > 0)
+                service->argv = service->interfaces + n_interfaces;
+
+        strings = (char *)(service->interfaces + n_interfaces + n_argv);
+        service->address = strings_append(&strings, "", address);
+
+        for (unsigned long i = 0; i < n_interfaces; i += 1)
+                service->interfaces[i] = strings_append(&strings, "", interfaces[i]);
+
+        if (executable) {
+                service->executable = strings_append(&strings, "", executable);
+                service->argv[0] = service->executable;
+                service->argv[1] = strings_append(&strings, "--varlink=", address);
 
-                service->listen_fd = listen_fd;
+                if (config) {
+                        service->config = strings_append(&strings, "", config);
+                        service->argv[2] = strings_append(&strings, "--config=", config);
+                }
         }
 
+        assert(strings == (char *)service + size);
+
+        service->uid = uid;
+        service->gid = gid;
         service->activate_at_startup = activate;
 
+        r = service_set_instances(service, 1, 1);
+        if (r < 0)
+                return r;
+
         *servicep = service;
         service = NULL;
 
         return 0;
 }
 
-long service_reset(Service *service) {
+/* Replaces the instances, the service must not be running. */
+long service_set_instances(Service *service, unsigned long n_instances, unsigned long n_instances_max) {
+        ServiceInstance *instances;
+
+        assert(service->n_running == 0);
+        assert(n_instances > 0 && n_instances <= n_instances_max);
+
+        instances = calloc(n_instances_max, sizeof(ServiceInstance));
+        if (!instances)
+                return -ENOMEM;
+
+        for (unsigned long i = 0; i < n_instances_max; i += 1) {
+                instances[i].service = service;
+                instances[i].pid = -1;
+                instances[i].pid_fd = -1;
+                instances[i].process_watch = SERVICE_WATCH_PROCESS;
+                instances[i].exec_fd = -1;
+                instances[i].exec_watch = SERVICE_WATCH_EXEC;
+                instances[i].restart_index = PRIOQ_INDEX_NULL;
+        }
+
+        free(service->instances);
+        service->instances = instances;
+        service->n_instances = n_instances;
+        service->n_instances_max = n_instances_max;
+
+        return 0;
+}
+
+/*
+ * Nothing is running, and one of the instances started by an activation
+ * is not waiting for its restart.
+ */
+bool service_can_activate(Service *service) {
+        if (!service->executable || service->n_running > 0)
+                return false;
+
+        for (unsigned long i = 0; i < service->n_instances; i += 1)
+                if (!service->instances[i].failed)
+                        return true;
+
+        return false;
+}
+
+static long service_parse_instances(Service *service, VarlinkObject *servicev) {
+        int64_t n_instances = 1;
+        int64_t n_instances_max;
+
+        varlink_object_get_int(servicev, "instances", &n_instances);
+        if (varlink_object_get_int(servicev, "max_instances", &n_instances_max) < 0)
+                n_instances_max = n_instances;
+
+        if (n_instances < 1 || n_instances_max < n_instances || n_instances_max > SERVICE_INSTANCES_MAX)
+                return -EUCLEAN;
+
+        if (n_instances_max == 1)
+                return 0;
+
+        return service_set_instances(service, n_instances, n_instances_max);
+}
+
+static long service_parse_idle(Service *service, VarlinkObject *idlev) {
+        int64_t i;
+
+        if (varlink_object_get_int(idlev, "min_lifetime_sec", &i) >= 0) {
+                if (i < 0)
+                        return -EUCLEAN;
+
+                service->min_lifetime_usec = i * USEC_PER_SEC;
+        }
+
+        if (varlink_object_get_int(idlev, "max_idle_sec", &i) >= 0) {
+                if (i < 0)
+                        return -EUCLEAN;
+
+                service->max_idle_usec = i * USEC_PER_SEC;
+        }
+
+        return 0;
+}
+
+long service_new_from_object(Service **servicep, VarlinkObject *servicev) {
+        _cleanup_(service_freep) Service *service = NULL;
+        VarlinkObject *executablev;
+        VarlinkObject *idlev;
+        VarlinkArray *interfacesv;
+        const char *address;
+        _cleanup_(freep) const char **interfaces = NULL;
+        long n_interfaces;
+        const char *executable = NULL;
+        uid_t uid = (uid_t)-1;
+        gid_t gid = (gid_t)-1;
+        bool activate = false;
+        long r;
+
+        if (varlink_object_get_string(servicev, "address", &address) < 0)
+                return -EUCLEAN;
+
+        if (varlink_object_get_object(servicev, "executable", &executablev) >= 0) {
+                int64_t i;
+
+                /* GetConfig returns the ids of services without an executable. */
+                varlink_object_get_string(executablev, "path", &executable);
+
+                if (varlink_object_get_int(executablev, "user_id", &i) >= 0)
+                        uid = i;
+
+                if (varlink_object_get_int(executablev, "group_id", &i) >= 0)
+                        gid = i;
+        }
+
+        varlink_object_get_bool(servicev, "activate_at_startup", &activate);
+
+        r = varlink_object_get_array(servicev, "interfaces", &interfacesv);
+        if (r < 0)
+                return r;
+
+        n_interfaces = varlink_array_get_n_elements(interfacesv);
+        if (n_interfaces < 0)
+                return n_interfaces;
+
+        interfaces = malloc(MAX(n_interfaces, 1L) * sizeof(char *));
+        if (!interfaces)
+                return -ENOMEM;
+
+        for (long i = 0; i < n_interfaces; i += 1) {
+                r = varlink_array_get_string(interfacesv, i, &interfaces[i]);
+                if (r < 0)
+                        return r;
+        }
+
+        r = service_new(&service,
+                        address,
+                        interfaces, n_interfaces,
+                        executable,
+                        uid, gid,
+                        activate,
+                        NULL);
+        if (r < 0)
+                return r;
+
+        r = service_parse_instances(service, servicev);
+        if (r < 0)
+                return r;
+
+        if (varlink_object_get_object(servicev, "idle", &idlev) >= 0) {
+                r = service_parse_idle(service, idlev);
+                if (r < 0)
+                        return r;
+        }
+
+        *servicep = service;
+        service = NULL;
+
+        return 0;
+}
+
+/* The counterpart of service_new_from_object(), as returned by GetConfig. */
+long service_to_object(Service *service, VarlinkObject **servicep) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *servicev = NULL;
+        _cleanup_(varlink_array_unrefp) VarlinkArray *interfacesv = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *executablev = NULL;
+        long r;
+
+        varlink_array_new(&interfacesv);
+
+        for (unsigned long i = 0; i < service->n_interfaces; i += 1) {
+                r = varlink_array_append_string(interfacesv, service->interfaces[i]);
+                if (r < 0)
+                        return r;
+        }
+
+        varlink_object_new(&executablev);
+        if (service->executable)
+                varlink_object_set_string(executablev, "path", service->executable);
+        varlink_object_set_int(executablev, "user_id", service->uid);
+        varlink_object_set_int(executablev, "group_id", service->gid);
+
+        varlink_object_new(&servicev);
+        varlink_object_set_string(servicev, "address", service->address);
+        varlink_object_set_array(servicev, "interfaces", interfacesv);
+        varlink_object_set_object(servicev, "executable", executablev);
+        varlink_object_set_bool(servicev, "activate_at_startup", service->activate_at_startup);
+
+        if (service->n_instances > 1)
+                varlink_object_set_int(servicev, "instances", service->n_instances);
+        if (service->n_instances_max > service->n_instances)
+                varlink_object_set_int(servicev, "max_instances", service->n_instances_max);
+
+        if (service->min_lifetime_usec > 0 || service->max_idle_usec > 0) {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *idlev = NULL;
+
+                varlink_object_new(&idlev);
+                if (service->min_lifetime_usec > 0)
+                        varlink_object_set_int(idlev, "min_lifetime_sec", service->min_lifetime_usec / USEC_PER_SEC);
+                if (service->max_idle_usec > 0)
+                        varlink_object_set_int(idlev, "max_idle_sec", service->max_idle_usec / USEC_PER_SEC);
+                varlink_object_set_object(servicev, "idle", idlev);
+        }
+
+        *servicep = servicev;
+        servicev = NULL;
+
+        return 0;
+}
+
+static bool streq_ptr(const char *s1, const char *s2) {
+        if (!s1 || !s2)
+                return s1 == s2;
+
+        return strcmp(s1, s2) == 0;
+}
+
+/* Compares everything which needs a new socket or child to change, not the idle policy. */
+bool service_equal(Service *service1, Service *service2) {
+        if (strcmp(service1->address, service2->address) != 0 ||
+            service1->n_interfaces != service2->n_interfaces ||
+            !streq_ptr(service1->executable, service2->executable) ||
+            !streq_ptr(service1->config, service2->config) ||
+            service1->uid != service2->uid ||
+            service1->gid != service2->gid ||
+            service1->activate_at_startup != service2->activate_at_startup ||
+            service1->n_instances != service2->n_instances ||
+            service1->n_instances_max != service2->n_instances_max)
+                return false;
+
+        for (unsigned long i = 0; i < service1->n_interfaces; i += 1)
+                if (strcmp(service1->interfaces[i], service2->interfaces[i]) != 0)
+                        return false;
+
+        return true;
+}
+
+long service_array_parse(ServiceArray *array, VarlinkArray *servicesv) {
+        long n_services;
+        long r;
+
+        n_services = varlink_array_get_n_elements(servicesv);
+        if (n_services < 0)
+                return n_services;
+
+        array->services = calloc(MAX(n_services, 1L), sizeof(Service *));
+        if (!array->services)
+                return -ENOMEM;
+
+        for (long s = 0; s < n_services; s += 1) {
+                VarlinkObject *servicev;
+
+                r = varlink_array_get_object(servicesv, s, &servicev);
+                if (r < 0)
+                        return r;
+
+                r = service_new_from_object(&array->services[s], servicev);
+                if (r < 0)
+                        return r;
+
+                array->n_services += 1;
+        }
+
+        return 0;
+}
+
+void service_array_clear(ServiceArray *array) {
+        for (unsigned long i = 0; i < array->n_services; i += 1)
+                if (array->services[i])
+                        service_free(array->services[i]);
+
+        free(array->services);
+        array->services = NULL;
+        array->n_services = 0;
+}
+
+long service_listen(Service *service) {
         int listen_fd;
 
+        if (!service->executable || service->listen_fd >= 0)
+                return 0;
+
+        listen_fd = varlink_listen(service->address, &service->path_to_unlink);
+        if (listen_fd < 0)
+                return listen_fd;
+
+        service->listen_fd = listen_fd;
+
+        return 0;
+}
+
+/*
+ * Creates the sockets of all services in one pass, before any of them
+ * is registered. Spreading bind() over threads did not pay off: the
+ * sockets of a configuration usually share a directory, whose inode
+ * lock serializes the binds.
+ */
+long service_listen_many(Service **services, unsigned long n_services) {
+        for (unsigned long i = 0; i < n_services; i += 1) {
+                long r;
+
+                r = service_listen(services[i]);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+/* Shares the listen socket of the service to replace, connections queued on it are kept. */
+long service_share_listen(Service *service, Service *service_old) {
+        _cleanup_(freep) char *path = NULL;
+        int fd;
+
+        if (!service->executable || service_old->listen_fd < 0)
+                return 0;
+
+        if (service_old->path_to_unlink) {
+                path = strdup(service_old->path_to_unlink);
+                if (!path)
+                        return -ENOMEM;
+        }
+
+        fd = fcntl(service_old->listen_fd, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+                return -errno;
+
+        service->listen_fd = fd;
+        service->path_to_unlink = path;
+        path = NULL;
+
+        return 0;
+}
+
+long service_reset(Service *service) {
         close(service->listen_fd);
         service->listen_fd = -1;
 
@@ -69,38 +446,50 @@ long service_reset(Service *service) {
                 service->path_to_unlink = NULL;
         }
 
-        listen_fd = varlink_listen(service->address, &service->path_to_unlink);
-        if (listen_fd < 0)
-                return listen_fd;
+        return service_listen(service);
+}
 
-        service->listen_fd = listen_fd;
+/* Terminates the running children and closes the listen socket. */
+void service_stop(Service *service) {
+        for (unsigned long i = 0; i < service->n_instances_max; i += 1) {
+                ServiceInstance *instance = &service->instances[i];
 
-        return 0;
-}
+                if (instance->pid >= 0) {
+                        kill(instance->pid, SIGTERM);
+                        instance->pid = -1;
+                }
 
-Service *service_free(Service *service) {
-        if (service->pid >= 0)
-                kill(service->pid, SIGTERM);
+                if (instance->pid_fd >= 0) {
+                        close(instance->pid_fd);
+                        instance->pid_fd = -1;
+                }
+
+                if (instance->exec_fd >= 0) {
+                        close(instance->exec_fd);
+                        instance->exec_fd = -1;
+                }
+        }
+
+        service->n_running = 0;
 
-        if (service->listen_fd >= 0)
+        if (service->listen_fd >= 0) {
                 close(service->listen_fd);
+                service->listen_fd = -1;
+        }
 
         if (service->path_to_unlink) {
                 unlink(service->path_to_unlink);
                 free(service->path_to_unlink);
+                service->path_to_unlink = NULL;
         }
+}
 
-        for (unsigned long i = 0; i < service->n_interfaces; i += 1)
-                free(service->interfaces[i]);
-        free(service->interfaces);
-
-        for (char *arg = *service->argv; arg ; arg++)
-                free(arg);
-        free(service->argv);
+Service *service_free(Service *service) {
+        service_stop(service);
+        free(service->instances);
+        free(service->stats.resolves);
 
-        free(service->address);
-        free(service->executable);
-        free(service->config);
+        /* The strings are part of the allocation. */
         free(service);
 
         return NULL;
@@ -111,44 +500,80 @@ void service_freep(Service **servicep) {
                 service_free(*servicep);
 }
 
-long service_activate(Service *service, sigset_t *mask) {
-        char s[32];
-
-        assert(service->executable);
-        assert(service->pid < 0);
+typedef struct {
+        ServiceInstance *instance;
+        const sigset_t *mask;
+        char **envp;
+        unsigned long n_envp;
+} SpawnContext;
+
+/* Runs on its own stack in the manager's address space, until execve(). */
+static int service_exec(void *userdata) {
+        SpawnContext *context = userdata;
+        Service *service = context->instance->service;
+
+        spawn_exec(service->argv,
+                   context->envp,
+                   context->n_envp,
+                   service->listen_fd,
+                   service->uid,
+                   service->gid,
+                   context->mask);
+}
 
-        service->pid = fork();
-        if (service->pid < 0)
+/*
+ * The child shares the address space of the manager and the manager is
+ * suspended until the child calls execve() or exits, the page tables are
+ * never copied. This keeps the cost of an activation independent of the
+ * size of the manager.
+ */
+long service_activate(ServiceInstance *instance, const char *notify_socket, sigset_t *mask) {
+        static const unsigned long stack_size = 64 * 1024;
+        _cleanup_(freep) char *stack = NULL;
+        _cleanup_(freep) char **envp = NULL;
+        SpawnContext context = {
+                .instance = instance,
+                .mask = mask,
+        };
+        pid_t pid;
+        long r;
+
+        assert(instance->service->executable);
+        assert(instance->pid < 0);
+
+        r = spawn_environment_new(&envp, &context.n_envp, notify_socket);
+        if (r < 0)
+                return r;
+
+        context.envp = envp;
+
+        stack = malloc(stack_size);
+        if (!stack)
+                return -ENOMEM;
+
+        pid = clone(service_exec, stack + stack_size, CLONE_VM | CLONE_VFORK | SIGCHLD, &context);
+        if (pid < 0)
                 return -errno;
 
-        if (service->pid > 0)
-                return 0;
-
-        sigprocmask(SIG_SETMASK, mask, NULL);
-
-        sprintf(s, "%d", getpid());
-        setenv("LISTEN_PID", s, true);
-        setenv("LISTEN_FDS", "1", true);
+        /* A failed exec is reaped and reported like any other exit of the child. */
+        instance->pid = pid;
 
-        /* Move activator fd to fd 3. All other fds have CLOEXEC set. */
-        if (dup2(service->listen_fd, 3) < 0)
-                return -errno;
-
-        if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0)
-                return -errno;
+        /* Without pidfd support, the exit is only noticed by SIGCHLD. */
+        instance->pid_fd = spawn_pidfd_open(pid);
 
-        if (service->executable[0] == '/' && chdir("/") < 0)
-                return -errno;
-
-        if (setsid() < 0)
-                return -errno;
+        return 0;
+}
 
-        if (service->gid > 0 && setresgid(service->gid, service->gid, service->gid) < 0)
-                return -errno;
+void service_reaped(ServiceInstance *instance) {
+        if (instance->pid_fd >= 0) {
+                close(instance->pid_fd);
+                instance->pid_fd = -1;
+        }
 
-        if (service->uid > 0 && setresuid(service->uid, service->uid, service->uid) < 0)
-                return -errno;
+        if (instance->exec_fd >= 0) {
+                close(instance->exec_fd);
+                instance->exec_fd = -1;
+        }
 
-        execve(service->argv[0], service->argv, environ);
-        _exit(errno);
+        instance->pid = -1;
 }
@@ -1,3 +1,7 @@
+#pragma once
+
+#include "prioq.h"
+#include "stats.h"
 #include "util.h"
 
 #include <signal.h>
@@ -5,12 +9,50 @@
 #include <unistd.h>
 #include <varlink.h>
 
+#define SERVICE_INSTANCES_MAX 1024
+
+/* Which of the service's fds an epoll event belongs to. */
+typedef enum {
+        SERVICE_WATCH_LISTEN,
+        SERVICE_WATCH_PROCESS,
+        SERVICE_WATCH_EXEC,
+} ServiceWatch;
+
+typedef struct Service Service;
+
+/*
+ * A child of a service. All instances share the listen socket of the
+ * service, every connection is accepted by one of them.
+ */
 typedef struct {
+        Service *service;
+
+        pid_t pid;
+        int pid_fd;
+        ServiceWatch process_watch;
+
+        /* The socket of the spawner which became the instance, it hangs up at the exec. */
+        int exec_fd;
+        ServiceWatch exec_watch;
+
+        /* Started, called exec(), and sent READY=1; zero until it happened. */
+        uint64_t started_usec;
+        uint64_t exec_usec;
+        uint64_t ready_usec;
+
+        /* Waiting in the restart queue after a failure. */
+        bool failed;
+        unsigned long n_failures;
+        unsigned long restart_index;
+} ServiceInstance;
+
+struct Service {
         char *address;
         unsigned long index;
 
         int listen_fd;
         char *path_to_unlink;
+        ServiceWatch listen_watch;
 
         unsigned long n_interfaces;
         char **interfaces;
@@ -23,9 +65,54 @@ typedef struct {
         char **argv;
         bool activate_at_startup;
 
-        pid_t pid;
-        bool failed;
-} Service;
+        /* Read from the configuration file, a reload may replace or remove it. */
+        bool configured;
+
+        /*
+         * An activation starts n_instances children. While connections
+         * wait in the listen queue, more are started, up to
+         * n_instances_max. The array has n_instances_max entries.
+         */
+        unsigned long n_instances;
+        unsigned long n_instances_max;
+        ServiceInstance *instances;
+        unsigned long n_running;
+
+        /* Consecutive samples of the listen queue which found a waiting connection. */
+        unsigned long n_pressure;
+        unsigned long pressure_index;
+
+        /* The listen socket is in the manager's epoll set. */
+        bool watched;
+
+        /*
+         * Idle policy, zero if unset. A running service is stopped after
+         * it was not resolved for max_idle_usec, but never before it ran
+         * for min_lifetime_usec.
+         */
+        uint64_t min_lifetime_usec;
+        uint64_t max_idle_usec;
+
+        /* First instance started, last resolve of one of its interfaces, and termination by us. */
+        uint64_t started_usec;
+        uint64_t used_usec;
+        uint64_t stopped_usec;
+        unsigned long idle_index;
+
+        /* Terminated because it was idle, the exits are not failures. */
+        bool stopping;
+
+        /* Stopped and no longer managed, waiting to be freed. */
+        bool removed;
+
+        ServiceStats stats;
+};
+
+/* Entries which are handed over to somebody else are set to NULL. */
+typedef struct {
+        Service **services;
+        unsigned long n_services;
+} ServiceArray;
 
 long service_new(Service **servicep,
                  const char *address,
@@ -35,7 +122,19 @@ long service_new(Service **servicep,
                  gid_t gid,
                  bool activate,
                  const char *config);
+long service_set_instances(Service *service, unsigned long n_instances, unsigned long n_instances_max);
+bool service_can_activate(Service *service);
+long service_new_from_object(Service **servicep, VarlinkObject *servicev);
+long service_to_object(Service *service, VarlinkObject **servicep);
+bool service_equal(Service *service1, Service *service2);
+void service_stop(Service *service);
 Service *service_free(Service *service);
 void service_freep(Service **servicep);
+long service_array_parse(ServiceArray *array, VarlinkArray *servicesv);
+void service_array_clear(ServiceArray *array);
+long service_listen(Service *service);
+long service_listen_many(Service **services, unsigned long n_services);
+long service_share_listen(Service *service, Service *service_old);
 long service_reset(Service *service);
-long service_activate(Service *service, sigset_t *mask);
+long service_activate(ServiceInstance *instance, const char *notify_socket, sigset_t *mask);
+void service_reaped(ServiceInstance *instance);
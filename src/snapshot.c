@@ -0,0 +1,345 @@
+#include "snapshot.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "VRSNAP\0\2"
+#define SNAPSHOT_NONE UINT32_MAX
+#define SNAPSHOT_ACTIVATE_AT_STARTUP 1U
+
+/*
+ * The file is the header, the array of services, and the strings they
+ * point to by offset. It is only read by the machine which wrote it, the
+ * integers are in native byte order.
+ */
+struct SnapshotHeader {
+        char magic[8];
+        uint64_t size;
+
+        /* The configuration file this was compiled from. */
+        uint64_t config_dev;
+        uint64_t config_ino;
+        uint64_t config_size;
+        uint64_t config_mtime_nsec;
+
+        uint32_t vendor;
+        uint32_t product;
+        uint32_t version;
+        uint32_t url;
+
+        uint32_t n_services;
+        uint32_t strings_size;
+};
+
+/* The interface names are stored one after the other. */
+struct SnapshotService {
+        uint32_t address;
+        uint32_t interfaces;
+        uint32_t n_interfaces;
+        uint32_t executable;
+        uint32_t uid;
+        uint32_t gid;
+        uint32_t min_lifetime_sec;
+        uint32_t max_idle_sec;
+        uint32_t n_instances;
+        uint32_t n_instances_max;
+        uint32_t flags;
+};
+
+static uint64_t stat_mtime_nsec(const struct stat *st) {
+        return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+/* Returns NULL for an unset or invalid offset, the strings end with a NUL byte. */
+static const char *snapshot_string(Snapshot *snapshot, uint32_t offset) {
+        if (offset >= snapshot->header->strings_size)
+                return NULL;
+
+        return snapshot->strings + offset;
+}
+
+long snapshot_open(Snapshot **snapshotp, const char *path, const struct stat *config_st) {
+        _cleanup_(snapshot_freep) Snapshot *snapshot = NULL;
+        _cleanup_(closep) int fd = -1;
+        const SnapshotHeader *header;
+        struct stat st;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if ((unsigned long)st.st_size < sizeof(SnapshotHeader))
+                return -EBADMSG;
+
+        snapshot = calloc(1, sizeof(Snapshot));
+        if (!snapshot)
+                return -ENOMEM;
+
+        snapshot->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (snapshot->map == MAP_FAILED) {
+                snapshot->map = NULL;
+                return -errno;
+        }
+
+        snapshot->size = st.st_size;
+        snapshot->header = header = snapshot->map;
+
+        if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+            header->size != snapshot->size ||
+            header->size != sizeof(SnapshotHeader) +
+                            (uint64_t)header->n_services * sizeof(SnapshotService) +
+                            header->strings_size)
+                return -EBADMSG;
+
+        if (header->config_dev != (uint64_t)config_st->st_dev ||
+            header->config_ino != (uint64_t)config_st->st_ino ||
+            header->config_size != (uint64_t)config_st->st_size ||
+            header->config_mtime_nsec != stat_mtime_nsec(config_st))
+                return -ESTALE;
+
+        snapshot->services = (const SnapshotService *)(header + 1);
+        snapshot->strings = (const char *)(snapshot->services + header->n_services);
+
+        if (header->strings_size > 0 && snapshot->strings[header->strings_size - 1] != '\0')
+                return -EBADMSG;
+
+        snapshot->vendor = snapshot_string(snapshot, header->vendor);
+        snapshot->product = snapshot_string(snapshot, header->product);
+        snapshot->version = snapshot_string(snapshot, header->version);
+        snapshot->url = snapshot_string(snapshot, header->url);
+
+        *snapshotp = snapshot;
+        snapshot = NULL;
+
+        return 0;
+}
+
+Snapshot *snapshot_free(Snapshot *snapshot) {
+        if (snapshot->map)
+                munmap(snapshot->map, snapshot->size);
+
+        free(snapshot);
+
+        return NULL;
+}
+
+void snapshot_freep(Snapshot **snapshotp) {
+        if (*snapshotp)
+                snapshot_free(*snapshotp);
+}
+
+/* Creates the services, the strings are copied out of the mapping. */
+long snapshot_get_services(Snapshot *snapshot, ServiceArray *array) {
+        _cleanup_(freep) const char **interfaces = NULL;
+        unsigned long n_interfaces_allocated = 0;
+        uint32_t n_services = snapshot->header->n_services;
+        long r;
+
+        array->services = calloc(MAX(n_services, 1U), sizeof(Service *));
+        if (!array->services)
+                return -ENOMEM;
+
+        for (uint32_t s = 0; s < n_services; s += 1) {
+                const SnapshotService *entry = &snapshot->services[s];
+                const char *address;
+                const char *executable = NULL;
+                uint32_t offset = entry->interfaces;
+                Service *service;
+
+                /* Every name takes at least its NUL byte. */
+                if (entry->n_interfaces > snapshot->header->strings_size)
+                        return -EBADMSG;
+
+                if (entry->n_interfaces > n_interfaces_allocated) {
+                        const char **p;
+
+                        p = realloc(interfaces, entry->n_interfaces * sizeof(const char *));
+                        if (!p)
+                                return -ENOMEM;
+
+                        interfaces = p;
+                        n_interfaces_allocated = entry->n_interfaces;
+                }
+
+                address = snapshot_string(snapshot, entry->address);
+                if (!address)
+                        return -EBADMSG;
+
+                if (entry->executable != SNAPSHOT_NONE) {
+                        executable = snapshot_string(snapshot, entry->executable);
+                        if (!executable)
+                                return -EBADMSG;
+                }
+
+                for (uint32_t i = 0; i < entry->n_interfaces; i += 1) {
+                        interfaces[i] = snapshot_string(snapshot, offset);
+                        if (!interfaces[i])
+                                return -EBADMSG;
+
+                        offset += strlen(interfaces[i]) + 1;
+                }
+
+                r = service_new(&service,
+                                address,
+                                interfaces, entry->n_interfaces,
+                                executable,
+                                entry->uid, entry->gid,
+                                entry->flags & SNAPSHOT_ACTIVATE_AT_STARTUP,
+                                NULL);
+                if (r < 0)
+                        return r;
+
+                array->services[s] = service;
+                array->n_services += 1;
+
+                service->min_lifetime_usec = entry->min_lifetime_sec * USEC_PER_SEC;
+                service->max_idle_usec = entry->max_idle_sec * USEC_PER_SEC;
+
+                if (entry->n_instances == 0 ||
+                    entry->n_instances > entry->n_instances_max ||
+                    entry->n_instances_max > SERVICE_INSTANCES_MAX)
+                        return -EBADMSG;
+
+                if (entry->n_instances_max > 1) {
+                        r = service_set_instances(service, entry->n_instances, entry->n_instances_max);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        return 0;
+}
+
+static unsigned long string_size(const char *string) {
+        return string ? strlen(string) + 1 : 0;
+}
+
+/* Copies the string to the end of the strings, and returns its offset. */
+static uint32_t strings_add(char *strings, unsigned long *sizep, const char *string) {
+        uint32_t offset = *sizep;
+
+        if (!string)
+                return SNAPSHOT_NONE;
+
+        *sizep = stpcpy(strings + offset, string) + 1 - strings;
+
+        return offset;
+}
+
+/*
+ * Compiles the configured services into a snapshot. The file is written
+ * next to the target and renamed over it, readers never see a partial
+ * snapshot.
+ */
+long snapshot_write(const char *path,
+                    const struct stat *config_st,
+                    const char *vendor,
+                    const char *product,
+                    const char *version,
+                    const char *url,
+                    Service **services, unsigned long n_services) {
+        _cleanup_(freep) char *data = NULL;
+        _cleanup_(freep) char *path_tmp = NULL;
+        _cleanup_(closep) int fd = -1;
+        SnapshotHeader *header;
+        SnapshotService *entries;
+        char *strings;
+        unsigned long n_configured = 0;
+        unsigned long strings_size;
+        unsigned long size;
+        long r;
+
+        strings_size = string_size(vendor) + string_size(product) + string_size(version) + string_size(url);
+
+        for (unsigned long s = 0; s < n_services; s += 1) {
+                Service *service = services[s];
+
+                if (!service->configured)
+                        continue;
+
+                n_configured += 1;
+                strings_size += string_size(service->address) + string_size(service->executable);
+
+                for (unsigned long i = 0; i < service->n_interfaces; i += 1)
+                        strings_size += string_size(service->interfaces[i]);
+        }
+
+        if (strings_size >= SNAPSHOT_NONE || n_configured >= UINT32_MAX)
+                return -E2BIG;
+
+        size = sizeof(SnapshotHeader) + n_configured * sizeof(SnapshotService) + strings_size;
+
+        data = calloc(1, size);
+        if (!data)
+                return -ENOMEM;
+
+        header = (SnapshotHeader *)data;
+        entries = (SnapshotService *)(header + 1);
+        strings = (char *)(entries + n_configured);
+        strings_size = 0;
+
+        memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+        header->size = size;
+        header->config_dev = config_st->st_dev;
+        header->config_ino = config_st->st_ino;
+        header->config_size = config_st->st_size;
+        header->config_mtime_nsec = stat_mtime_nsec(config_st);
+        header->vendor = strings_add(strings, &strings_size, vendor);
+        header->product = strings_add(strings, &strings_size, product);
+        header->version = strings_add(strings, &strings_size, version);
+        header->url = strings_add(strings, &strings_size, url);
+        header->n_services = n_configured;
+
+        for (unsigned long s = 0; s < n_services; s += 1) {
+                Service *service = services[s];
+                SnapshotService *entry;
+
+                if (!service->configured)
+                        continue;
+
+                entry = entries;
+                entries += 1;
+
+                entry->address = strings_add(strings, &strings_size, service->address);
+                entry->executable = strings_add(strings, &strings_size, service->executable);
+                entry->n_interfaces = service->n_interfaces;
+                entry->interfaces = strings_size;
+                for (unsigned long i = 0; i < service->n_interfaces; i += 1)
+                        strings_add(strings, &strings_size, service->interfaces[i]);
+
+                entry->uid = service->uid;
+                entry->gid = service->gid;
+                entry->min_lifetime_sec = service->min_lifetime_usec / USEC_PER_SEC;
+                entry->max_idle_sec = service->max_idle_usec / USEC_PER_SEC;
+                entry->n_instances = service->n_instances;
+                entry->n_instances_max = service->n_instances_max;
+                entry->flags = service->activate_at_startup ? SNAPSHOT_ACTIVATE_AT_STARTUP : 0;
+        }
+
+        header->strings_size = strings_size;
+
+        if (asprintf(&path_tmp, "%s.XXXXXX", path) < 0) {
+                path_tmp = NULL;
+                return -ENOMEM;
+        }
+
+        fd = mkostemp(path_tmp, O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        r = write_all(fd, data, size);
+        if (r >= 0 && rename(path_tmp, path) < 0)
+                r = -errno;
+
+        if (r < 0)
+                unlink(path_tmp);
+
+        return r;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "service.h"
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+typedef struct SnapshotHeader SnapshotHeader;
+typedef struct SnapshotService SnapshotService;
+
+/*
+ * A compiled copy of the configuration file, mapped read-only and turned
+ * into services without parsing JSON. It records the identity of the file
+ * it was compiled from, and is stale as soon as that file changed.
+ */
+typedef struct {
+        void *map;
+        unsigned long size;
+
+        const SnapshotHeader *header;
+        const SnapshotService *services;
+        const char *strings;
+
+        const char *vendor;
+        const char *product;
+        const char *version;
+        const char *url;
+} Snapshot;
+
+long snapshot_open(Snapshot **snapshotp, const char *path, const struct stat *config_st);
+Snapshot *snapshot_free(Snapshot *snapshot);
+void snapshot_freep(Snapshot **snapshotp);
+long snapshot_get_services(Snapshot *snapshot, ServiceArray *array);
+long snapshot_write(const char *path,
+                    const struct stat *config_st,
+                    const char *vendor,
+                    const char *product,
+                    const char *version,
+                    const char *url,
+                    Service **services, unsigned long n_services);
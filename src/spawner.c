@@ -0,0 +1,584 @@
+#include "spawner.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+#ifndef __NR_pidfd_send_signal
+#define __NR_pidfd_send_signal 424
+#endif
+
+#ifndef __NR_close_range
+#define __NR_close_range 436
+#endif
+
+#define SPAWNER_REQUEST_MAX 8192
+#define SPAWNER_ARGV_MAX 8
+
+/* Followed by the NUL-terminated arguments, the listen fd is attached. */
+typedef struct {
+        uid_t uid;
+        gid_t gid;
+        uint32_t n_argv;
+} SpawnerRequest;
+
+/* The zygote's answer, the socket of the spawner is attached. */
+typedef struct {
+        pid_t pid;
+        int error;
+} ZygoteReply;
+
+/* What a spawner cloned by the zygote needs to run. */
+typedef struct {
+        int fd;
+        int max_fd;
+        pid_t parent;
+        char **envp;
+        unsigned long n_envp;
+        const sigset_t *mask;
+} ZygoteContext;
+
+int spawn_pidfd_open(pid_t pid) {
+        return syscall(__NR_pidfd_open, pid, 0);
+}
+
+/*
+ * Our environment without LISTEN_* and NOTIFY_SOCKET, the given
+ * NOTIFY_SOCKET= entry, LISTEN_FDS=1, a free slot for LISTEN_PID, NULL
+ */
+long spawn_environment_new(char ***envpp, unsigned long *n_envpp, const char *notify_socket) {
+        char **envp;
+        unsigned long n_environ = 0;
+        unsigned long n_envp = 0;
+
+        while (environ[n_environ])
+                n_environ += 1;
+
+        envp = calloc(n_environ + 4, sizeof(char *));
+        if (!envp)
+                return -ENOMEM;
+
+        for (unsigned long i = 0; i < n_environ; i += 1) {
+                if (strncmp(environ[i], "LISTEN_FDS=", 11) == 0 ||
+                    strncmp(environ[i], "LISTEN_PID=", 11) == 0 ||
+                    strncmp(environ[i], "NOTIFY_SOCKET=", 14) == 0)
+                        continue;
+
+                envp[n_envp] = environ[i];
+                n_envp += 1;
+        }
+
+        if (notify_socket) {
+                envp[n_envp] = (char *)notify_socket;
+                n_envp += 1;
+        }
+
+        envp[n_envp] = (char *)"LISTEN_FDS=1";
+        n_envp += 1;
+
+        *envpp = envp;
+        *n_envpp = n_envp;
+
+        return 0;
+}
+
+/*
+ * Turns the calling child into the service. Nothing in here may allocate
+ * or touch the manager's state, the child might share its memory or be
+ * forked from a multi-threaded process.
+ *
+ * The signal mask and the ids are set with raw system calls, like
+ * posix_spawn() does. The glibc wrappers of setresuid(), setresgid()
+ * and setgroups() signal all threads of the process to change their ids
+ * too. A child sharing the memory of the manager would change the ids of
+ * the manager's threads, or deadlock on a lock a worker holds while the
+ * manager waits for the exec.
+ */
+void spawn_exec(char **argv,
+                char **envp,
+                unsigned long n_envp,
+                int listen_fd,
+                uid_t uid,
+                gid_t gid,
+                const sigset_t *mask) {
+        char listen_pid[32] = "LISTEN_PID=";
+        char digits[16];
+        unsigned long n_digits = 0;
+        unsigned long k;
+
+        syscall(SYS_rt_sigprocmask, SIG_SETMASK, mask, NULL, _NSIG / 8);
+
+        for (pid_t pid = getpid(); pid > 0; pid /= 10) {
+                digits[n_digits] = '0' + pid % 10;
+                n_digits += 1;
+        }
+
+        k = strlen(listen_pid);
+        while (n_digits > 0) {
+                n_digits -= 1;
+                listen_pid[k] = digits[n_digits];
+                k += 1;
+        }
+
+        listen_pid[k] = '\0';
+        envp[n_envp] = listen_pid;
+
+        /* Move activator fd to fd 3. All other fds have CLOEXEC set. */
+        if (listen_fd == 3) {
+                if (fcntl(3, F_SETFD, 0) < 0)
+                        _exit(errno);
+        } else if (dup2(listen_fd, 3) < 0)
+                _exit(errno);
+
+        if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0)
+                _exit(errno);
+
+        if (argv[0][0] == '/' && chdir("/") < 0)
+                _exit(errno);
+
+        if (setsid() < 0)
+                _exit(errno);
+
+        /* The supplementary groups of the manager must not be kept. */
+        if ((uid > 0 || gid > 0) && syscall(SYS_setgroups, 0, NULL) < 0)
+                _exit(errno);
+
+        if (gid > 0 && syscall(SYS_setresgid, gid, gid, gid) < 0)
+                _exit(errno);
+
+        if (uid > 0 && syscall(SYS_setresuid, uid, uid, uid) < 0)
+                _exit(errno);
+
+        execve(argv[0], argv, envp);
+        _exit(errno);
+}
+
+/* The spawner must not keep the listen sockets of other services alive. */
+static void spawner_close_fds(int keep, int max_fd) {
+        if (syscall(__NR_close_range, 3, keep - 1, 0) == 0 &&
+            syscall(__NR_close_range, keep + 1, ~0U, 0) == 0)
+                return;
+
+        for (int fd = 3; fd < max_fd; fd += 1)
+                if (fd != keep)
+                        close(fd);
+}
+
+__attribute__((__noreturn__)) static void spawner_run(int fd,
+                                                      int max_fd,
+                                                      pid_t parent,
+                                                      char **envp,
+                                                      unsigned long n_envp,
+                                                      const sigset_t *mask) {
+        union {
+                SpawnerRequest request;
+                char data[SPAWNER_REQUEST_MAX];
+        } buffer;
+        union {
+                struct cmsghdr header;
+                char data[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct iovec iov = {
+                .iov_base = &buffer,
+                .iov_len = sizeof(buffer) - 1,
+        };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = &control,
+                .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg;
+        char *argv[SPAWNER_ARGV_MAX + 1];
+        int listen_fd;
+        char *p;
+        long n;
+
+        /* Unblock SIGTERM, to follow the manager when it dies. */
+        sigprocmask(SIG_SETMASK, mask, NULL);
+
+        if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 || getppid() != parent)
+                _exit(EXIT_SUCCESS);
+
+        spawner_close_fds(fd, max_fd);
+
+        do
+                n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        while (n < 0 && errno == EINTR);
+
+        /* The manager closed the socket, we are not needed anymore. */
+        if (n <= 0)
+                _exit(EXIT_SUCCESS);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                _exit(EINVAL);
+
+        memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+
+        if ((unsigned long)n < sizeof(SpawnerRequest) ||
+            buffer.request.n_argv == 0 ||
+            buffer.request.n_argv > SPAWNER_ARGV_MAX)
+                _exit(EINVAL);
+
+        buffer.data[n] = '\0';
+        p = buffer.data + sizeof(SpawnerRequest);
+        for (uint32_t i = 0; i < buffer.request.n_argv; i += 1) {
+                if (p >= buffer.data + n)
+                        _exit(EINVAL);
+
+                argv[i] = p;
+                p += strlen(p) + 1;
+        }
+
+        argv[buffer.request.n_argv] = NULL;
+
+        /*
+         * Our end of the socket closes with the exec, which tells the
+         * manager. It must not be in the way of the listen fd.
+         */
+        if (fd == 3) {
+                fcntl(fd, F_DUPFD_CLOEXEC, 4);
+                close(fd);
+        }
+
+        spawn_exec(argv, envp, n_envp, listen_fd, buffer.request.uid, buffer.request.gid, mask);
+}
+
+static int spawner_max_fd(void) {
+        struct rlimit rl;
+        int max_fd = 65536;
+
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+                max_fd = MIN(rl.rlim_cur, (rlim_t)max_fd);
+
+        return max_fd;
+}
+
+/*
+ * Forks a spawner. The envp is prepared by spawn_environment_new(), the
+ * spawner fills in its own LISTEN_PID.
+ */
+long spawner_new(Spawner **spawnerp, char **envp, unsigned long n_envp, const sigset_t *mask) {
+        _cleanup_(spawner_freep) Spawner *spawner = NULL;
+        pid_t parent = getpid();
+        int max_fd = spawner_max_fd();
+        int fds[2];
+
+        spawner = calloc(1, sizeof(Spawner));
+        if (!spawner)
+                return -ENOMEM;
+
+        spawner->pid = -1;
+        spawner->pid_fd = -1;
+        spawner->fd = -1;
+
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+                return -errno;
+
+        spawner->fd = fds[0];
+
+        spawner->pid = fork();
+        if (spawner->pid < 0) {
+                close(fds[1]);
+                return -errno;
+        }
+
+        if (spawner->pid == 0)
+                spawner_run(fds[1], max_fd, parent, envp, n_envp, mask);
+
+        close(fds[1]);
+
+        spawner->pid_fd = spawn_pidfd_open(spawner->pid);
+
+        *spawnerp = spawner;
+        spawner = NULL;
+
+        return 0;
+}
+
+static int zygote_spawner_run(void *userdata) {
+        ZygoteContext *context = userdata;
+
+        spawner_run(context->fd, context->max_fd, context->parent, context->envp, context->n_envp, context->mask);
+}
+
+/*
+ * Clones a spawner for every byte the manager sends. With CLONE_PARENT,
+ * the spawners are children of the manager, which reaps them and their
+ * services like the ones it forked itself.
+ */
+__attribute__((__noreturn__)) static void zygote_run(int fd,
+                                                     int max_fd,
+                                                     pid_t parent,
+                                                     char **envp,
+                                                     unsigned long n_envp,
+                                                     const sigset_t *mask) {
+        static char stack[65536] __attribute__((__aligned__(16)));
+        ZygoteContext context = {
+                .max_fd = max_fd,
+                .parent = parent,
+                .envp = envp,
+                .n_envp = n_envp,
+                .mask = mask,
+        };
+
+        sigprocmask(SIG_SETMASK, mask, NULL);
+
+        if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 || getppid() != parent)
+                _exit(EXIT_SUCCESS);
+
+        spawner_close_fds(fd, max_fd);
+
+        for (;;) {
+                ZygoteReply reply = {
+                        .pid = -1,
+                };
+                union {
+                        struct cmsghdr header;
+                        char data[CMSG_SPACE(sizeof(int))];
+                } control = {};
+                struct iovec iov = {
+                        .iov_base = &reply,
+                        .iov_len = sizeof(reply),
+                };
+                struct msghdr msg = {
+                        .msg_iov = &iov,
+                        .msg_iovlen = 1,
+                };
+                struct cmsghdr *cmsg;
+                int fds[2];
+                char c;
+                long n;
+
+                do
+                        n = recv(fd, &c, 1, 0);
+                while (n < 0 && errno == EINTR);
+
+                /* The manager closed the socket, we are not needed anymore. */
+                if (n <= 0)
+                        _exit(EXIT_SUCCESS);
+
+                if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+                        reply.error = errno;
+                        fds[0] = -1;
+                } else {
+                        context.fd = fds[1];
+                        reply.pid = clone(zygote_spawner_run, stack + sizeof(stack), CLONE_PARENT | SIGCHLD, &context);
+                        if (reply.pid < 0)
+                                reply.error = errno;
+
+                        close(fds[1]);
+                }
+
+                if (reply.pid > 0) {
+                        msg.msg_control = &control;
+                        msg.msg_controllen = sizeof(control);
+
+                        cmsg = CMSG_FIRSTHDR(&msg);
+                        cmsg->cmsg_level = SOL_SOCKET;
+                        cmsg->cmsg_type = SCM_RIGHTS;
+                        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                        memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int));
+                }
+
+                if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0)
+                        _exit(EXIT_SUCCESS);
+
+                if (fds[0] >= 0)
+                        close(fds[0]);
+        }
+}
+
+/*
+ * Forks the zygote, which forks the spawners for us. Forked early, it
+ * copies only the page tables of a small, single-threaded manager, and
+ * so does every spawner it forks.
+ */
+long spawn_zygote_new(int *fdp, char **envp, unsigned long n_envp, const sigset_t *mask) {
+        pid_t parent = getpid();
+        int max_fd = spawner_max_fd();
+        int fds[2];
+        pid_t pid;
+
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+                return -errno;
+
+        pid = fork();
+        if (pid < 0) {
+                close(fds[0]);
+                close(fds[1]);
+                return -errno;
+        }
+
+        if (pid == 0)
+                zygote_run(fds[1], max_fd, parent, envp, n_envp, mask);
+
+        close(fds[1]);
+        *fdp = fds[0];
+
+        return 0;
+}
+
+/* Asks the zygote for a spawner. A zygote which died returns -EPIPE. */
+long spawner_new_from_zygote(Spawner **spawnerp, int zygote_fd) {
+        _cleanup_(spawner_freep) Spawner *spawner = NULL;
+        ZygoteReply reply;
+        union {
+                struct cmsghdr header;
+                char data[CMSG_SPACE(sizeof(int))];
+        } control = {};
+        struct iovec iov = {
+                .iov_base = &reply,
+                .iov_len = sizeof(reply),
+        };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = &control,
+                .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg;
+        long n;
+
+        spawner = calloc(1, sizeof(Spawner));
+        if (!spawner)
+                return -ENOMEM;
+
+        spawner->pid = -1;
+        spawner->pid_fd = -1;
+        spawner->fd = -1;
+
+        if (send(zygote_fd, "", 1, MSG_NOSIGNAL) < 0)
+                return -errno;
+
+        do
+                n = recvmsg(zygote_fd, &msg, MSG_CMSG_CLOEXEC);
+        while (n < 0 && errno == EINTR);
+
+        if (n < 0)
+                return -errno;
+
+        if (n != sizeof(reply))
+                return -EPIPE;
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                memcpy(&spawner->fd, CMSG_DATA(cmsg), sizeof(int));
+
+        if (reply.pid <= 0)
+                return reply.error > 0 ? -reply.error : -EIO;
+
+        /* Without its socket, the spawner exits by itself. */
+        if (spawner->fd < 0)
+                return -EIO;
+
+        spawner->pid = reply.pid;
+        spawner->pid_fd = spawn_pidfd_open(spawner->pid);
+
+        *spawnerp = spawner;
+        spawner = NULL;
+
+        return 0;
+}
+
+/*
+ * A spawner which was not handed to a service is terminated. Its pid is
+ * reset when it is reaped; the pidfd cannot refer to another process.
+ */
+Spawner *spawner_free(Spawner *spawner) {
+        if (spawner->fd >= 0)
+                close(spawner->fd);
+
+        if (spawner->pid_fd >= 0) {
+                syscall(__NR_pidfd_send_signal, spawner->pid_fd, SIGTERM, NULL, 0);
+                close(spawner->pid_fd);
+        } else if (spawner->pid > 0)
+                kill(spawner->pid, SIGTERM);
+
+        free(spawner);
+
+        return NULL;
+}
+
+void spawner_freep(Spawner **spawnerp) {
+        if (*spawnerp)
+                spawner_free(*spawnerp);
+}
+
+/*
+ * Sends the service's listen fd and command line to the spawner, which
+ * becomes the process of the instance. Returns without waiting for the exec,
+ * a failure shows up as the exit of the service. The socket is handed to
+ * the instance, it is closed by the exec.
+ */
+long spawner_activate(Spawner *spawner, ServiceInstance *instance) {
+        Service *service = instance->service;
+        union {
+                SpawnerRequest request;
+                char data[SPAWNER_REQUEST_MAX];
+        } buffer = {};
+        union {
+                struct cmsghdr header;
+                char data[CMSG_SPACE(sizeof(int))];
+        } control = {};
+        struct iovec iov = {
+                .iov_base = &buffer,
+        };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = &control,
+                .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg;
+        unsigned long size = sizeof(SpawnerRequest);
+
+        assert(instance->pid < 0);
+
+        buffer.request.uid = service->uid;
+        buffer.request.gid = service->gid;
+
+        for (char **arg = service->argv; *arg; arg++) {
+                unsigned long length = strlen(*arg) + 1;
+
+                /* The spawner NUL-terminates the request, keep one byte. */
+                if (buffer.request.n_argv == SPAWNER_ARGV_MAX || size + length >= sizeof(buffer))
+                        return -E2BIG;
+
+                memcpy(buffer.data + size, *arg, length);
+                size += length;
+                buffer.request.n_argv += 1;
+        }
+
+        iov.iov_len = size;
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &service->listen_fd, sizeof(int));
+
+        if (sendmsg(spawner->fd, &msg, MSG_NOSIGNAL) < 0)
+                return -errno;
+
+        instance->pid = spawner->pid;
+        instance->pid_fd = spawner->pid_fd;
+        instance->exec_fd = spawner->fd;
+        spawner->pid = -1;
+        spawner->pid_fd = -1;
+        spawner->fd = -1;
+
+        return 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "service.h"
+
+#include <signal.h>
+#include <sys/types.h>
+
+/*
+ * A child forked ahead of time, waiting on a socket for the listen fd and
+ * the command line of a service, to exec() it right away.
+ */
+typedef struct {
+        pid_t pid;
+        int pid_fd;
+        int fd;
+} Spawner;
+
+int spawn_pidfd_open(pid_t pid);
+long spawn_environment_new(char ***envpp, unsigned long *n_envpp, const char *notify_socket);
+__attribute__((__noreturn__)) void spawn_exec(char **argv,
+                                              char **envp,
+                                              unsigned long n_envp,
+                                              int listen_fd,
+                                              uid_t uid,
+                                              gid_t gid,
+                                              const sigset_t *mask);
+
+long spawn_zygote_new(int *fdp, char **envp, unsigned long n_envp, const sigset_t *mask);
+
+long spawner_new(Spawner **spawnerp, char **envp, unsigned long n_envp, const sigset_t *mask);
+long spawner_new_from_zygote(Spawner **spawnerp, int zygote_fd);
+Spawner *spawner_free(Spawner *spawner);
+void spawner_freep(Spawner **spawnerp);
+long spawner_activate(Spawner *spawner, ServiceInstance *instance);
@@ -0,0 +1,133 @@
+#include "stats.h"
+#include "util.h"
+
+static long histogram_to_object(Histogram *h, VarlinkObject **histogramp) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *histogram = NULL;
+        _cleanup_(varlink_array_unrefp) VarlinkArray *buckets = NULL;
+        unsigned long n_buckets = HISTOGRAM_BUCKETS;
+        long r;
+
+        /* Trailing empty buckets are left out. */
+        while (n_buckets > 0 && counter_get(&h->buckets[n_buckets - 1]) == 0)
+                n_buckets -= 1;
+
+        varlink_array_new(&buckets);
+        for (unsigned long i = 0; i < n_buckets; i += 1) {
+                r = varlink_array_append_int(buckets, counter_get(&h->buckets[i]));
+                if (r < 0)
+                        return r;
+        }
+
+        varlink_object_new(&histogram);
+        varlink_object_set_array(histogram, "buckets", buckets);
+        varlink_object_set_int(histogram, "count", counter_get(&h->count));
+        varlink_object_set_int(histogram, "sum_usec", counter_get(&h->sum_usec));
+
+        *histogramp = histogram;
+        histogram = NULL;
+
+        return 0;
+}
+
+static void histogram_add_histogram(Histogram *h, Histogram *shard) {
+        for (unsigned long i = 0; i < HISTOGRAM_BUCKETS; i += 1)
+                h->buckets[i] += counter_get(&shard->buckets[i]);
+
+        h->count += counter_get(&shard->count);
+        h->sum_usec += counter_get(&shard->sum_usec);
+}
+
+/* Adds the counters of resolves of another thread to a private copy of the stats. */
+void stats_add_resolves(Stats *stats, Stats *shard) {
+        uint64_t first_resolve_usec = counter_get(&shard->first_resolve_usec);
+
+        stats->n_resolves += counter_get(&shard->n_resolves);
+        stats->n_resolve_misses += counter_get(&shard->n_resolve_misses);
+        stats->n_filter_rejects += counter_get(&shard->n_filter_rejects);
+        stats->n_filter_false_positives += counter_get(&shard->n_filter_false_positives);
+        histogram_add_histogram(&stats->resolve, &shard->resolve);
+
+        if (first_resolve_usec > 0 && (stats->first_resolve_usec == 0 || first_resolve_usec < stats->first_resolve_usec))
+                stats->first_resolve_usec = first_resolve_usec;
+}
+
+long stats_to_object(Stats *stats, VarlinkObject **statsp) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *statsv = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *resolve = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *activation = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *teardown = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *exec = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *ready = NULL;
+        long r;
+
+        r = histogram_to_object(&stats->resolve, &resolve);
+        if (r < 0)
+                return r;
+
+        r = histogram_to_object(&stats->activation, &activation);
+        if (r < 0)
+                return r;
+
+        r = histogram_to_object(&stats->teardown, &teardown);
+        if (r < 0)
+                return r;
+
+        r = histogram_to_object(&stats->exec, &exec);
+        if (r < 0)
+                return r;
+
+        r = histogram_to_object(&stats->ready, &ready);
+        if (r < 0)
+                return r;
+
+        varlink_object_new(&statsv);
+        varlink_object_set_int(statsv, "resolves", counter_get(&stats->n_resolves));
+        varlink_object_set_int(statsv, "resolve_misses", counter_get(&stats->n_resolve_misses));
+        varlink_object_set_int(statsv, "filter_rejects", counter_get(&stats->n_filter_rejects));
+        varlink_object_set_int(statsv, "filter_false_positives", counter_get(&stats->n_filter_false_positives));
+        varlink_object_set_int(statsv, "activations", counter_get(&stats->n_activations));
+        varlink_object_set_int(statsv, "activation_failures", counter_get(&stats->n_activation_failures));
+        varlink_object_set_int(statsv, "crashes", counter_get(&stats->n_crashes));
+        varlink_object_set_int(statsv, "restarts", counter_get(&stats->n_restarts));
+        varlink_object_set_int(statsv, "idle_stops", counter_get(&stats->n_idle_stops));
+        varlink_object_set_int(statsv, "evictions", counter_get(&stats->n_evictions));
+        varlink_object_set_int(statsv, "scale_ups", counter_get(&stats->n_scale_ups));
+        varlink_object_set_object(statsv, "resolve_latency", resolve);
+        varlink_object_set_object(statsv, "activation_latency", activation);
+        varlink_object_set_object(statsv, "teardown_latency", teardown);
+        varlink_object_set_object(statsv, "exec_latency", exec);
+        varlink_object_set_object(statsv, "ready_latency", ready);
+        varlink_object_set_int(statsv, "startup_usec", counter_get(&stats->startup_usec));
+        varlink_object_set_int(statsv, "first_resolve_usec", counter_get(&stats->first_resolve_usec));
+        varlink_object_set_bool(statsv, "config_from_snapshot", stats->config_from_snapshot);
+
+        *statsp = statsv;
+        statsv = NULL;
+
+        return 0;
+}
+
+long service_stats_to_object(ServiceStats *stats, VarlinkObject **statsp) {
+        VarlinkObject *statsv;
+        uint64_t n_resolves = 0;
+
+        for (unsigned long i = 0; i < stats->n_resolve_shards; i += 1)
+                n_resolves += counter_get(&stats->resolves[i].value);
+
+        varlink_object_new(&statsv);
+        varlink_object_set_int(statsv, "resolves", n_resolves);
+        varlink_object_set_int(statsv, "activations", counter_get(&stats->n_activations));
+        varlink_object_set_int(statsv, "crashes", counter_get(&stats->n_crashes));
+        varlink_object_set_int(statsv, "restarts", counter_get(&stats->n_restarts));
+        varlink_object_set_int(statsv, "backoff_usec", counter_get(&stats->backoff_usec));
+        varlink_object_set_int(statsv, "idle_stops", counter_get(&stats->n_idle_stops));
+        varlink_object_set_int(statsv, "evictions", counter_get(&stats->n_evictions));
+        varlink_object_set_int(statsv, "scale_ups", counter_get(&stats->n_scale_ups));
+        varlink_object_set_int(statsv, "running_usec", counter_get(&stats->running_usec));
+        varlink_object_set_int(statsv, "exec_usec", counter_get(&stats->exec_usec));
+        varlink_object_set_int(statsv, "ready_usec", counter_get(&stats->ready_usec));
+
+        *statsp = statsv;
+
+        return 0;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <varlink.h>
+
+/*
+ * Bucket i counts the samples of less than 2^i microseconds, and of at
+ * least 2^(i-1); the last bucket also counts all longer samples.
+ */
+#define HISTOGRAM_BUCKETS 24
+
+/*
+ * Counters and histograms are updated with relaxed atomics, readers
+ * might see a sample in a bucket before it shows up in the count. The
+ * counters of resolves are kept by every thread for itself and written
+ * with plain stores, they are summed up when they are read.
+ */
+typedef struct {
+        uint64_t buckets[HISTOGRAM_BUCKETS];
+        uint64_t count;
+        uint64_t sum_usec;
+} Histogram;
+
+/* A counter in a cache line of its own, one for every thread counting the same event. */
+typedef struct {
+        uint64_t value;
+} __attribute__((aligned(64))) CounterShard;
+
+typedef struct {
+        /* Slot 0 for the main thread, slot i + 1 for worker i. */
+        CounterShard *resolves;
+        unsigned long n_resolve_shards;
+
+        uint64_t n_activations;
+        uint64_t n_crashes;
+        uint64_t n_restarts;
+        uint64_t backoff_usec;
+        uint64_t n_idle_stops;
+        uint64_t n_evictions;
+
+        /* Instances started because connections waited in the listen queue. */
+        uint64_t n_scale_ups;
+
+        /* Summed up when an instance exits. */
+        uint64_t running_usec;
+
+        /* The latest samples of the exec and ready histograms, for this service. */
+        uint64_t exec_usec;
+        uint64_t ready_usec;
+} ServiceStats;
+
+typedef struct {
+        uint64_t n_resolves;
+        uint64_t n_resolve_misses;
+
+        /* Misses rejected by the filter, and misses which passed it. */
+        uint64_t n_filter_rejects;
+        uint64_t n_filter_false_positives;
+        uint64_t n_activations;
+        uint64_t n_activation_failures;
+        uint64_t n_crashes;
+        uint64_t n_restarts;
+
+        /* Services stopped after their idle time, and to make room for another one. */
+        uint64_t n_idle_stops;
+        uint64_t n_evictions;
+
+        /* Instances started because connections waited in the listen queue. */
+        uint64_t n_scale_ups;
+
+        /* From the call to the reply. */
+        Histogram resolve;
+
+        /* From fork() until the child called exec(), or until a spawner got the service. */
+        Histogram activation;
+
+        /* From terminating an idle or evicted service until it exited. */
+        Histogram teardown;
+
+        /* From the start of an instance until it called exec(), and until it sent READY=1. */
+        Histogram exec;
+        Histogram ready;
+
+        /*
+         * From the start of the resolver until it handled events, and
+         * until the first resolve replied. The services were created from
+         * a snapshot instead of the configuration file.
+         */
+        uint64_t start_usec;
+        uint64_t startup_usec;
+        uint64_t first_resolve_usec;
+        bool config_from_snapshot;
+} Stats;
+
+static inline void counter_add(uint64_t *counter, uint64_t n) {
+        __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline void counter_inc(uint64_t *counter) {
+        counter_add(counter, 1);
+}
+
+static inline uint64_t counter_get(uint64_t *counter) {
+        return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* For counters written by a single thread, without a locked instruction. */
+static inline void counter_add_owned(uint64_t *counter, uint64_t n) {
+        __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void counter_inc_owned(uint64_t *counter) {
+        counter_add_owned(counter, 1);
+}
+
+static inline unsigned long histogram_bucket(uint64_t usec) {
+        unsigned long bucket = usec > 0 ? 64 - __builtin_clzll(usec) : 0;
+
+        return MIN(bucket, HISTOGRAM_BUCKETS - 1UL);
+}
+
+static inline void histogram_add(Histogram *h, uint64_t usec) {
+        counter_inc(&h->buckets[histogram_bucket(usec)]);
+        counter_inc(&h->count);
+        counter_add(&h->sum_usec, usec);
+}
+
+static inline void histogram_add_owned(Histogram *h, uint64_t usec) {
+        counter_inc_owned(&h->buckets[histogram_bucket(usec)]);
+        counter_inc_owned(&h->count);
+        counter_add_owned(&h->sum_usec, usec);
+}
+
+/* Only the first call of the owning thread records the time. */
+static inline void stats_first_resolve(Stats *stats) {
+        if (stats->first_resolve_usec == 0)
+                __atomic_store_n(&stats->first_resolve_usec, MAX(now_usec() - stats->start_usec, 1ULL), __ATOMIC_RELAXED);
+}
+
+void stats_add_resolves(Stats *stats, Stats *shard);
+long stats_to_object(Stats *stats, VarlinkObject **statsp);
+long service_stats_to_object(ServiceStats *stats, VarlinkObject **statsp);
@@ -0,0 +1,208 @@
+#include "subscription.h"
+#include "util.h"
+
+#include <errno.h>
+#include <string.h>
+
+struct Subscription {
+        SubscriptionList *list;
+        unsigned long index;
+
+        VarlinkCall *call;
+
+        /* The last address sent for every interface, NULL if not found. */
+        unsigned long n_interfaces;
+        char **interfaces;
+        char **addresses;
+};
+
+static Subscription *subscription_free(Subscription *subscription) {
+        if (subscription->call)
+                varlink_call_unref(subscription->call);
+
+        for (unsigned long i = 0; i < subscription->n_interfaces; i += 1) {
+                free(subscription->interfaces[i]);
+                free(subscription->addresses[i]);
+        }
+
+        free(subscription->interfaces);
+        free(subscription->addresses);
+        free(subscription);
+
+        return NULL;
+}
+
+static void subscription_freep(Subscription **subscriptionp) {
+        if (*subscriptionp)
+                subscription_free(*subscriptionp);
+}
+
+static void subscription_remove(Subscription *subscription) {
+        SubscriptionList *list = subscription->list;
+
+        /* Move last subscription to current slot */
+        list->n_subscriptions -= 1;
+        list->subscriptions[subscription->index] = list->subscriptions[list->n_subscriptions];
+        list->subscriptions[subscription->index]->index = subscription->index;
+
+        subscription_free(subscription);
+}
+
+static void subscription_canceled(VarlinkCall *call, void *userdata) {
+        subscription_remove(userdata);
+}
+
+/*
+ * Replies with the interfaces whose address changed since the last reply,
+ * or with all interfaces for the first one. Does not reply if nothing
+ * changed.
+ */
+static long subscription_update(Subscription *subscription, InterfaceIndex *index, bool all, uint64_t flags) {
+        _cleanup_(varlink_array_unrefp) VarlinkArray *changes = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *reply = NULL;
+        unsigned long n_changes = 0;
+        long r;
+
+        varlink_array_new(&changes);
+
+        for (unsigned long i = 0; i < subscription->n_interfaces; i += 1) {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *change = NULL;
+                const char *address = NULL;
+                bool rejected;
+                Service *service;
+
+                service = interface_index_lookup(index, subscription->interfaces[i], &rejected);
+                if (service)
+                        address = service->address;
+
+                if (!all) {
+                        if (!address && !subscription->addresses[i])
+                                continue;
+
+                        if (address && subscription->addresses[i] && strcmp(address, subscription->addresses[i]) == 0)
+                                continue;
+                }
+
+                free(subscription->addresses[i]);
+                subscription->addresses[i] = NULL;
+                if (address) {
+                        subscription->addresses[i] = strdup(address);
+                        if (!subscription->addresses[i])
+                                return -ENOMEM;
+                }
+
+                varlink_object_new(&change);
+                varlink_object_set_string(change, "interface", subscription->interfaces[i]);
+                if (address)
+                        varlink_object_set_string(change, "address", address);
+                else
+                        varlink_object_set_null(change, "address");
+
+                r = varlink_array_append_object(changes, change);
+                if (r < 0)
+                        return r;
+
+                n_changes += 1;
+        }
+
+        if (!all && n_changes == 0)
+                return 0;
+
+        varlink_object_new(&reply);
+        varlink_object_set_array(reply, "changes", changes);
+
+        return varlink_call_reply(subscription->call, reply, flags);
+}
+
+long subscription_list_add(SubscriptionList *list,
+                           VarlinkCall *call,
+                           VarlinkArray *interfacesv,
+                           uint64_t flags,
+                           InterfaceIndex *index) {
+        _cleanup_(subscription_freep) Subscription *subscription = NULL;
+        long n_interfaces;
+        long r;
+
+        n_interfaces = varlink_array_get_n_elements(interfacesv);
+        if (n_interfaces < 0)
+                return n_interfaces;
+
+        subscription = calloc(1, sizeof(Subscription));
+        if (!subscription)
+                return -ENOMEM;
+
+        subscription->interfaces = calloc(MAX(n_interfaces, 1L), sizeof(char *));
+        subscription->addresses = calloc(MAX(n_interfaces, 1L), sizeof(char *));
+        if (!subscription->interfaces || !subscription->addresses)
+                return -ENOMEM;
+
+        for (long i = 0; i < n_interfaces; i += 1) {
+                const char *interface;
+
+                r = varlink_array_get_string(interfacesv, i, &interface);
+                if (r < 0)
+                        return -EINVAL;
+
+                subscription->interfaces[i] = strdup(interface);
+                if (!subscription->interfaces[i])
+                        return -ENOMEM;
+
+                subscription->n_interfaces += 1;
+        }
+
+        subscription->call = varlink_call_ref(call);
+
+        /* Without "more", the call gets the current addresses and is done. */
+        if (!(flags & VARLINK_CALL_MORE))
+                return subscription_update(subscription, index, true, 0);
+
+        if (list->n_subscriptions == list->n_allocated) {
+                unsigned long n_allocated = MAX(list->n_allocated * 2, 16UL);
+                Subscription **subscriptions;
+
+                subscriptions = realloc(list->subscriptions, n_allocated * sizeof(Subscription *));
+                if (!subscriptions)
+                        return -ENOMEM;
+
+                list->subscriptions = subscriptions;
+                list->n_allocated = n_allocated;
+        }
+
+        r = subscription_update(subscription, index, true, VARLINK_REPLY_CONTINUES);
+        if (r < 0)
+                return r;
+
+        subscription->list = list;
+        subscription->index = list->n_subscriptions;
+        list->subscriptions[list->n_subscriptions] = subscription;
+        list->n_subscriptions += 1;
+
+        varlink_call_set_canceled_callback(call, subscription_canceled, subscription);
+        subscription = NULL;
+
+        return 0;
+}
+
+void subscription_list_notify(SubscriptionList *list, InterfaceIndex *index) {
+        /* Backwards, a failed subscription is replaced by the last one. */
+        for (unsigned long i = list->n_subscriptions; i > 0; i -= 1) {
+                Subscription *subscription = list->subscriptions[i - 1];
+
+                if (subscription_update(subscription, index, false, VARLINK_REPLY_CONTINUES) < 0) {
+                        varlink_call_set_canceled_callback(subscription->call, NULL, NULL);
+                        subscription_remove(subscription);
+                }
+        }
+}
+
+void subscription_list_clear(SubscriptionList *list) {
+        for (unsigned long i = 0; i < list->n_subscriptions; i += 1) {
+                varlink_call_set_canceled_callback(list->subscriptions[i]->call, NULL, NULL);
+                subscription_free(list->subscriptions[i]);
+        }
+
+        free(list->subscriptions);
+        list->subscriptions = NULL;
+        list->n_subscriptions = 0;
+        list->n_allocated = 0;
+}
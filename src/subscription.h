@@ -0,0 +1,27 @@
+#pragma once
+
+#include "interface-index.h"
+
+#include <stdint.h>
+#include <varlink.h>
+
+typedef struct Subscription Subscription;
+
+/*
+ * Calls which asked for more replies, and get one with the changed
+ * addresses of their interfaces after every change of the index. A list
+ * belongs to a thread, only that thread replies to its calls.
+ */
+typedef struct {
+        Subscription **subscriptions;
+        unsigned long n_subscriptions;
+        unsigned long n_allocated;
+} SubscriptionList;
+
+long subscription_list_add(SubscriptionList *list,
+                           VarlinkCall *call,
+                           VarlinkArray *interfacesv,
+                           uint64_t flags,
+                           InterfaceIndex *index);
+void subscription_list_notify(SubscriptionList *list, InterfaceIndex *index);
+void subscription_list_clear(SubscriptionList *list);
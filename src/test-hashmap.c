@@ -0,0 +1,184 @@
+#include "hashmap.h"
+#include "util.h"
+
+#include <assert.h>
+#include <string.h>
+
+/* Keys with a chosen hash, to place entries in known buckets. */
+typedef struct {
+        uint64_t hash;
+        int id;
+} Key;
+
+static unsigned long n_compares;
+
+static uint64_t key_hash(const void *key) {
+        return ((const Key *)key)->hash;
+}
+
+static bool key_equal(const void *key1, const void *key2) {
+        n_compares += 1;
+
+        return ((const Key *)key1)->id == ((const Key *)key2)->id;
+}
+
+static const HashOps key_hash_ops = {
+        .hash = key_hash,
+        .equal = key_equal,
+};
+
+static long entry_of(Hashmap *map, const Key *key) {
+        for (unsigned long i = 0; i < map->n_buckets; i += 1)
+                if (map->entries[i].key == key)
+                        return i;
+
+        return -1;
+}
+
+/* The probe sequences of the last buckets continue at the first ones. */
+static void test_wraparound(void) {
+        _cleanup_(hashmap_freep) Hashmap *map = NULL;
+        Key keys[] = {
+                { 14, 0 },
+                { 14, 1 },
+                { 15, 2 },
+                { 14, 3 },
+                { 1, 4 },
+        };
+
+        assert(hashmap_new(&map, &key_hash_ops) == 0);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(keys); i += 1)
+                assert(hashmap_put(map, &keys[i], &keys[i]) == 0);
+
+        assert(map->n_buckets == 16);
+        assert(entry_of(map, &keys[0]) == 14);
+        assert(entry_of(map, &keys[1]) == 15);
+        assert(entry_of(map, &keys[2]) == 0);
+        assert(entry_of(map, &keys[3]) == 1);
+        assert(entry_of(map, &keys[4]) == 2);
+
+        /* Every entry after the hole moves back across the end of the table. */
+        assert(hashmap_remove(map, &keys[1]) == &keys[1]);
+        assert(entry_of(map, &keys[2]) == 15);
+        assert(entry_of(map, &keys[3]) == 0);
+        assert(entry_of(map, &keys[4]) == 1);
+        assert(map->entries[2].hash == 0);
+
+        /* Entries already at or before their home bucket stay. */
+        assert(hashmap_remove(map, &keys[0]) == &keys[0]);
+        assert(entry_of(map, &keys[2]) == 15);
+        assert(entry_of(map, &keys[3]) == 14);
+        assert(entry_of(map, &keys[4]) == 1);
+        assert(map->entries[0].hash == 0);
+
+        assert(hashmap_get(map, &keys[0]) == NULL);
+        assert(hashmap_get(map, &keys[1]) == NULL);
+        for (unsigned long i = 2; i < ARRAY_SIZE(keys); i += 1)
+                assert(hashmap_get(map, &keys[i]) == &keys[i]);
+
+        assert(map->n_entries == 3);
+}
+
+/* Keys are only compared when the stored hash matches. */
+static void test_stored_hash(void) {
+        _cleanup_(hashmap_freep) Hashmap *map = NULL;
+        Key keys[] = {
+                { 3, 10 },
+                { 19, 11 },
+                { 35, 12 },
+                { 35, 13 },
+                { 0, 14 },
+        };
+
+        assert(hashmap_new(&map, &key_hash_ops) == 0);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(keys); i += 1)
+                assert(hashmap_put(map, &keys[i], &keys[i]) == 0);
+
+        n_compares = 0;
+        assert(hashmap_get(map, &keys[2]) == &keys[2]);
+        assert(n_compares == 1);
+
+        n_compares = 0;
+        assert(hashmap_get(map, &keys[3]) == &keys[3]);
+        assert(n_compares == 2);
+
+        n_compares = 0;
+        assert(hashmap_get_hashed(map, &keys[1], 19) == &keys[1]);
+        assert(n_compares == 1);
+
+        /* A hash of zero marks empty buckets, such a key is stored anyway. */
+        assert(hashmap_get(map, &keys[4]) == &keys[4]);
+        assert(hashmap_put(map, &keys[4], NULL) == -EEXIST);
+        assert(hashmap_remove(map, &keys[4]) == &keys[4]);
+        assert(hashmap_get(map, &keys[4]) == NULL);
+}
+
+static void test_resize(void) {
+        _cleanup_(hashmap_freep) Hashmap *map = NULL;
+        _cleanup_(hashmap_freep) Hashmap *copy = NULL;
+        static char keys[1000][16];
+        static bool seen[1000];
+        unsigned long iterator = 0;
+        unsigned long n = 0;
+        const void *key;
+        void *value;
+
+        assert(hashmap_new(&map, &string_hash_ops) == 0);
+        assert(hashmap_get(map, "missing") == NULL);
+        assert(hashmap_remove(map, "missing") == NULL);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(keys); i += 1) {
+                snprintf(keys[i], sizeof(keys[i]), "key%lu", i);
+                assert(hashmap_put(map, keys[i], INT_TO_PTR(i + 1)) == 0);
+
+                /* A power of two, at most half full. */
+                assert((map->n_buckets & (map->n_buckets - 1)) == 0);
+                assert(map->n_entries * 2 <= map->n_buckets);
+        }
+
+        assert(hashmap_put(map, "key7", NULL) == -EEXIST);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(keys); i += 1)
+                assert(hashmap_get(map, keys[i]) == INT_TO_PTR(i + 1));
+
+        while (hashmap_iterate(map, &iterator, &key, &value)) {
+                unsigned long i = PTR_TO_INT(value) - 1;
+
+                assert(i < ARRAY_SIZE(keys));
+                assert(key == keys[i]);
+                assert(!seen[i]);
+                seen[i] = true;
+                n += 1;
+        }
+
+        assert(n == ARRAY_SIZE(keys));
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(keys); i += 2)
+                assert(hashmap_remove(map, keys[i]) == INT_TO_PTR(i + 1));
+
+        assert(map->n_entries == ARRAY_SIZE(keys) / 2);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(keys); i += 1)
+                assert(hashmap_get(map, keys[i]) == (i % 2 ? INT_TO_PTR(i + 1) : NULL));
+
+        assert(hashmap_copy(map, &copy) == 0);
+        assert(hashmap_remove(map, keys[1]) == INT_TO_PTR(2));
+        assert(hashmap_get(copy, keys[1]) == INT_TO_PTR(2));
+
+        iterator = 0;
+        n = 0;
+        while (hashmap_iterate(copy, &iterator, NULL, NULL))
+                n += 1;
+
+        assert(n == ARRAY_SIZE(keys) / 2);
+}
+
+int main(void) {
+        test_wraparound();
+        test_stored_hash();
+        test_resize();
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,142 @@
+#include "prioq.h"
+#include "util.h"
+
+#include <assert.h>
+
+typedef struct {
+        uint64_t priority;
+        unsigned long index;
+} Item;
+
+/* The heap order holds, and every item knows its slot. */
+static void check_heap(Prioq *q) {
+        for (unsigned long i = 0; i < q->n_items; i += 1) {
+                Item *item = q->items[i].data;
+
+                assert(item->index == i);
+                assert(q->items[i].indexp == &item->index);
+                assert(q->items[i].priority == item->priority);
+
+                if (i > 0)
+                        assert(q->items[(i - 1) / 2].priority <= q->items[i].priority);
+        }
+}
+
+static void test_remove(void) {
+        _cleanup_(prioq_freep) Prioq *q = NULL;
+        Item items[15];
+        Item *middle = NULL;
+        Item *last;
+
+        assert(prioq_new(&q) == 0);
+        assert(prioq_peek(q, NULL) == NULL);
+        assert(prioq_pop(q) == NULL);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(items); i += 1) {
+                items[i].priority = (i * 7) % ARRAY_SIZE(items);
+                items[i].index = PRIOQ_INDEX_NULL;
+                assert(prioq_put(q, &items[i], items[i].priority, &items[i].index) == 0);
+        }
+
+        check_heap(q);
+
+        /* An inner slot, the last item moves into the hole. */
+        for (unsigned long i = 0; i < ARRAY_SIZE(items); i += 1)
+                if (items[i].index == q->n_items / 2 - 1)
+                        middle = &items[i];
+
+        assert(middle);
+        prioq_remove(q, &middle->index);
+        assert(middle->index == PRIOQ_INDEX_NULL);
+        assert(q->n_items == ARRAY_SIZE(items) - 1);
+        check_heap(q);
+
+        last = q->items[q->n_items - 1].data;
+        prioq_remove(q, &last->index);
+        assert(last->index == PRIOQ_INDEX_NULL);
+        assert(q->n_items == ARRAY_SIZE(items) - 2);
+        check_heap(q);
+
+        /* Removing twice, or an item which is not queued, does nothing. */
+        prioq_remove(q, &middle->index);
+        assert(q->n_items == ARRAY_SIZE(items) - 2);
+
+        /* Putting a queued item again changes its priority. */
+        assert(prioq_put(q, last, 100, &last->index) == 0);
+        last->priority = 100;
+        assert(prioq_put(q, &items[3], 0, &items[3].index) == 0);
+        items[3].priority = 0;
+        assert(q->n_items == ARRAY_SIZE(items) - 1);
+        check_heap(q);
+        assert(prioq_peek(q, NULL) == &items[0] || prioq_peek(q, NULL) == &items[3]);
+}
+
+static void test_random(void) {
+        _cleanup_(prioq_freep) Prioq *q = NULL;
+        static Item items[2000];
+        unsigned int seed = 1;
+        uint64_t previous = 0;
+        unsigned long n = 0;
+        Item *item;
+
+        assert(prioq_new(&q) == 0);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(items); i += 1) {
+                items[i].priority = rand_r(&seed) % 500;
+                items[i].index = PRIOQ_INDEX_NULL;
+                assert(prioq_put(q, &items[i], items[i].priority, &items[i].index) == 0);
+
+                /* Now and then, remove a random earlier item. */
+                if (rand_r(&seed) % 3 == 0) {
+                        Item *victim = &items[rand_r(&seed) % (i + 1)];
+
+                        prioq_remove(q, &victim->index);
+                        assert(victim->index == PRIOQ_INDEX_NULL);
+                }
+        }
+
+        check_heap(q);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(items); i += 1)
+                if (items[i].index != PRIOQ_INDEX_NULL)
+                        n += 1;
+
+        assert(n == q->n_items);
+
+        for (uint64_t priority; (item = prioq_peek(q, &priority)); n -= 1) {
+                assert(priority == item->priority);
+                assert(priority >= previous);
+                previous = priority;
+
+                assert(prioq_pop(q) == item);
+                assert(item->index == PRIOQ_INDEX_NULL);
+        }
+
+        assert(n == 0);
+}
+
+/* Freeing the queue resets the indexes of the items still in it. */
+static void test_free(void) {
+        Prioq *q;
+        Item items[3];
+
+        assert(prioq_new(&q) == 0);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(items); i += 1) {
+                items[i].index = PRIOQ_INDEX_NULL;
+                assert(prioq_put(q, &items[i], i, &items[i].index) == 0);
+        }
+
+        prioq_free(q);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(items); i += 1)
+                assert(items[i].index == PRIOQ_INDEX_NULL);
+}
+
+int main(void) {
+        test_remove();
+        test_random();
+        test_free();
+
+        return EXIT_SUCCESS;
+}
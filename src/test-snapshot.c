@@ -0,0 +1,216 @@
+/* The test writes broken snapshots, it needs the layout of the file. */
+#include "snapshot.c"
+
+#include <assert.h>
+#include <stddef.h>
+
+typedef struct {
+        char directory[64];
+        char config[96];
+        char path[96];
+        struct stat config_st;
+
+        char *data;
+        unsigned long size;
+} Test;
+
+static SnapshotHeader *test_header(char *data) {
+        return (SnapshotHeader *)data;
+}
+
+static SnapshotService *test_services(char *data) {
+        return (SnapshotService *)(test_header(data) + 1);
+}
+
+/* Writes the variant of the snapshot, and reads it like the resolver. */
+static long test_load(Test *t, const char *data, unsigned long size, const struct stat *config_st) {
+        _cleanup_(snapshot_freep) Snapshot *snapshot = NULL;
+        _cleanup_(service_array_clear) ServiceArray array = {};
+        _cleanup_(closep) int fd = -1;
+        long r;
+
+        fd = open(t->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        assert(fd >= 0);
+        assert(write_all(fd, data, size) >= 0);
+
+        r = snapshot_open(&snapshot, t->path, config_st);
+        if (r < 0)
+                return r;
+
+        return snapshot_get_services(snapshot, &array);
+}
+
+/* Copies the valid snapshot, changes one field of the header or of a service, and loads it. */
+#define test_load_modified(_t, _lvalue, _value)                                         \
+        ({                                                                              \
+                _cleanup_(freep) char *_copy = malloc((_t)->size);                      \
+                                                                                        \
+                assert(_copy);                                                          \
+                memcpy(_copy, (_t)->data, (_t)->size);                                  \
+                _lvalue = (_value);                                                     \
+                test_load((_t), _copy, (_t)->size, &(_t)->config_st);                   \
+        })
+
+#define test_load_header(_t, _field, _value) \
+        test_load_modified(_t, test_header(_copy)->_field, _value)
+
+#define test_load_service(_t, _s, _field, _value) \
+        test_load_modified(_t, test_services(_copy)[_s]._field, _value)
+
+static void test_setup(Test *t) {
+        _cleanup_(fclosep) FILE *f = NULL;
+        Service *services[2];
+        const char *interfaces[] = { "org.example.a", "org.example.b" };
+        _cleanup_(closep) int fd = -1;
+        struct stat st;
+
+        strcpy(t->directory, "/tmp/test-snapshot-XXXXXX");
+        assert(mkdtemp(t->directory));
+        snprintf(t->config, sizeof(t->config), "%s/config.json", t->directory);
+        snprintf(t->path, sizeof(t->path), "%s/config.snapshot", t->directory);
+
+        f = fopen(t->config, "we");
+        assert(f);
+        fprintf(f, "{}\n");
+        assert(fflush(f) == 0);
+        assert(stat(t->config, &t->config_st) == 0);
+
+        assert(service_new(&services[0], "unix:/run/a", interfaces, 2, "/usr/bin/a", 1, 2, true, NULL) == 0);
+        assert(service_new(&services[1], "unix:/run/b", interfaces + 1, 1, NULL, 0, 0, false, NULL) == 0);
+        assert(service_set_instances(services[0], 2, 4) == 0);
+        services[0]->configured = true;
+        services[1]->configured = true;
+
+        assert(snapshot_write(t->path, &t->config_st, "Vendor", "Product", "1", NULL, services, 2) == 0);
+
+        service_free(services[0]);
+        service_free(services[1]);
+
+        fd = open(t->path, O_RDONLY | O_CLOEXEC);
+        assert(fd >= 0);
+        assert(fstat(fd, &st) == 0);
+
+        t->size = st.st_size;
+        t->data = malloc(t->size);
+        assert(t->data);
+        assert(read(fd, t->data, t->size) == (ssize_t)t->size);
+}
+
+static void test_valid(Test *t) {
+        _cleanup_(snapshot_freep) Snapshot *snapshot = NULL;
+        _cleanup_(service_array_clear) ServiceArray array = {};
+
+        assert(snapshot_open(&snapshot, t->path, &t->config_st) == 0);
+        assert(strcmp(snapshot->vendor, "Vendor") == 0);
+        assert(strcmp(snapshot->version, "1") == 0);
+        assert(snapshot->url == NULL);
+
+        assert(snapshot_get_services(snapshot, &array) == 0);
+        assert(array.n_services == 2);
+
+        assert(strcmp(array.services[0]->address, "unix:/run/a") == 0);
+        assert(strcmp(array.services[0]->executable, "/usr/bin/a") == 0);
+        assert(array.services[0]->n_interfaces == 2);
+        assert(strcmp(array.services[0]->interfaces[1], "org.example.b") == 0);
+        assert(array.services[0]->uid == 1);
+        assert(array.services[0]->gid == 2);
+        assert(array.services[0]->activate_at_startup);
+        assert(array.services[0]->n_instances == 2);
+        assert(array.services[0]->n_instances_max == 4);
+
+        assert(array.services[1]->executable == NULL);
+        assert(array.services[1]->n_interfaces == 1);
+        assert(strcmp(array.services[1]->interfaces[0], "org.example.b") == 0);
+}
+
+static void test_truncated(Test *t) {
+        assert(test_load(t, t->data, 0, &t->config_st) == -EBADMSG);
+        assert(test_load(t, t->data, sizeof(SnapshotHeader) - 1, &t->config_st) == -EBADMSG);
+        assert(test_load(t, t->data, sizeof(SnapshotHeader), &t->config_st) == -EBADMSG);
+        assert(test_load(t, t->data, t->size - 1, &t->config_st) == -EBADMSG);
+}
+
+static void test_header_fields(Test *t) {
+        SnapshotHeader *header = test_header(t->data);
+
+        assert(test_load_header(t, magic[0], 'X') == -EBADMSG);
+        assert(test_load_header(t, size, t->size + 1) == -EBADMSG);
+        assert(test_load_header(t, size, t->size - 1) == -EBADMSG);
+        assert(test_load_header(t, n_services, header->n_services + 1) == -EBADMSG);
+        assert(test_load_header(t, n_services, UINT32_MAX) == -EBADMSG);
+        assert(test_load_header(t, strings_size, header->strings_size - 1) == -EBADMSG);
+}
+
+static void test_strings(Test *t) {
+        SnapshotHeader *header = test_header(t->data);
+        SnapshotService *services = test_services(t->data);
+        _cleanup_(freep) char *copy = NULL;
+
+        assert(test_load_service(t, 0, address, header->strings_size) == -EBADMSG);
+        assert(test_load_service(t, 0, address, SNAPSHOT_NONE) == -EBADMSG);
+        assert(test_load_service(t, 0, executable, header->strings_size) == -EBADMSG);
+        assert(test_load_service(t, 1, interfaces, header->strings_size) == -EBADMSG);
+        assert(test_load_service(t, 1, n_interfaces, header->strings_size + 1) == -EBADMSG);
+        assert(test_load_service(t, 1, n_interfaces, UINT32_MAX) == -EBADMSG);
+
+        /* The names of the last service run off the end of the strings. */
+        assert(test_load_service(t, 1, n_interfaces, services[1].n_interfaces + 1) == -EBADMSG);
+
+        /* The last string is not terminated. */
+        copy = malloc(t->size);
+        assert(copy);
+        memcpy(copy, t->data, t->size);
+        copy[t->size - 1] = 'x';
+        assert(test_load(t, copy, t->size, &t->config_st) == -EBADMSG);
+}
+
+static void test_instances(Test *t) {
+        SnapshotService *services = test_services(t->data);
+
+        assert(test_load_service(t, 0, n_instances, 0) == -EBADMSG);
+        assert(test_load_service(t, 0, n_instances, services[0].n_instances_max + 1) == -EBADMSG);
+        assert(test_load_service(t, 0, n_instances_max, 1) == -EBADMSG);
+        assert(test_load_service(t, 0, n_instances_max, SERVICE_INSTANCES_MAX + 1) == -EBADMSG);
+        assert(test_load_service(t, 0, n_instances_max, UINT32_MAX) == -EBADMSG);
+}
+
+static void test_stale(Test *t) {
+        struct stat st = t->config_st;
+        struct timespec times[2] = {
+                { .tv_nsec = UTIME_OMIT },
+                { .tv_sec = 1 },
+        };
+
+        st.st_size += 1;
+        assert(test_load(t, t->data, t->size, &st) == -ESTALE);
+
+        st = t->config_st;
+        st.st_ino += 1;
+        assert(test_load(t, t->data, t->size, &st) == -ESTALE);
+
+        /* The file was touched after the snapshot was written. */
+        assert(utimensat(AT_FDCWD, t->config, times, 0) == 0);
+        assert(stat(t->config, &st) == 0);
+        assert(test_load(t, t->data, t->size, &st) == -ESTALE);
+
+        assert(test_load(t, t->data, t->size, &t->config_st) == 0);
+}
+
+int main(void) {
+        Test t = {};
+
+        test_setup(&t);
+        test_valid(&t);
+        test_truncated(&t);
+        test_header_fields(&t);
+        test_strings(&t);
+        test_instances(&t);
+        test_stale(&t);
+
+        unlink(t.path);
+        unlink(t.config);
+        rmdir(t.directory);
+        free(t.data);
+
+        return EXIT_SUCCESS;
+}
@@ -1,9 +1,13 @@
 #pragma once
 
 #include <dirent.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #define _cleanup_(_x) __attribute__((__cleanup__(_x)))
@@ -32,3 +36,35 @@ static inline void closedirp(DIR **dirp) {
 #define MAX(_a, _b) ((_a) > (_b) ? (_a) : (_b))
 #define ARRAY_SIZE(_x) (sizeof(_x) / sizeof((_x)[0]))
 #define ALIGN_TO(_val, _to) (((_val) + (_to) - 1) & ~((_to) - 1))
+#define container_of(_ptr, _type, _member) ((_type *)((char *)(_ptr) - offsetof(_type, _member)))
+
+#define USEC_PER_SEC 1000000ULL
+
+static inline uint64_t now_usec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static inline long write_all(int fd, const void *data, unsigned long size) {
+        const char *p = data;
+
+        while (size > 0) {
+                long n;
+
+                n = write(fd, p, size);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                }
+
+                p += n;
+                size -= n;
+        }
+
+        return 0;
+}